@@ -874,43 +874,37 @@ public:
         m_csWindowCreate.Term();
     }
 
+    // Creation data is only ever extracted on the thread that added it, so
+    // it is kept on a per-thread stack instead of the shared
+    // m_pCreateWndList. m_csWindowCreate still guards class registration.
     void AddCreateWndData(_AtlCreateWndData* pData, void* pObject) noexcept
     {
         ATLASSERT(pData != NULL && pObject != NULL);
         pData->m_pThis = pObject;
         pData->m_dwThreadID = ::GetCurrentThreadId();
 
-        CComCritSecLock<CComCriticalSection> lock(m_csWindowCreate, false);
-        if (SUCCEEDED(lock.Lock())) {
-            pData->m_pNext = m_pCreateWndList;
-            m_pCreateWndList = pData;
-        }
+        _AtlCreateWndData*& pList = GetThreadCreateWndList();
+        pData->m_pNext = pList;
+        pList = pData;
     }
 
     void* ExtractCreateWndData() noexcept
     {
-        CComCritSecLock<CComCriticalSection> lock(m_csWindowCreate, false);
-        if (FAILED(lock.Lock()))
+        _AtlCreateWndData*& pList = GetThreadCreateWndList();
+        _AtlCreateWndData* pEntry = pList;
+        if (pEntry == NULL)
             return NULL;
 
-        void* pv = NULL;
-        DWORD dwThreadID = ::GetCurrentThreadId();
-        _AtlCreateWndData* pEntry = m_pCreateWndList;
-        _AtlCreateWndData* pPrev = NULL;
-
-        while (pEntry != NULL) {
-            if (pEntry->m_dwThreadID == dwThreadID) {
-                pv = pEntry->m_pThis;
-                if (pPrev == NULL)
-                    m_pCreateWndList = pEntry->m_pNext;
-                else
-                    pPrev->m_pNext = pEntry->m_pNext;
-                break;
-            }
-            pPrev = pEntry;
-            pEntry = pEntry->m_pNext;
-        }
-        return pv;
+        ATLASSERT(pEntry->m_dwThreadID == ::GetCurrentThreadId());
+        pList = pEntry->m_pNext;
+        return pEntry->m_pThis;
+    }
+
+private:
+    static _AtlCreateWndData*& GetThreadCreateWndList() noexcept
+    {
+        static thread_local _AtlCreateWndData* s_pList = NULL;
+        return s_pList;
     }
 };
 
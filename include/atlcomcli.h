@@ -7,6 +7,8 @@
 #pragma once
 
 #include "atldef.h"
+#include "atlsimpcoll.h"
+#include "atlconv.h"
 
 #include <ole2.h>
 #include <memory>
@@ -294,11 +296,11 @@ public:
     CComBSTR(LPCSTR pSrc) : m_str(NULL)
     {
         if (pSrc != NULL) {
-            int nLen = ::MultiByteToWideChar(CP_ACP, 0, pSrc, -1, NULL, 0);
+            int nLen = AtlMultiByteToWideChar(CP_ACP, pSrc, -1, NULL, 0);
             if (nLen > 0) {
                 m_str = ::SysAllocStringLen(NULL, nLen - 1);
                 if (m_str != NULL)
-                    ::MultiByteToWideChar(CP_ACP, 0, pSrc, -1, m_str, nLen);
+                    AtlMultiByteToWideChar(CP_ACP, pSrc, -1, m_str, nLen);
             }
         }
     }
@@ -593,6 +595,37 @@ public:
     }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleRelocateTraits specializations
+//
+// CComPtr, CComBSTR and CComVariant own a pointer or a VARIANT that does
+// not refer back to the object, so the simple collections may move them
+// with realloc / memmove.
+
+template <typename T>
+class CSimpleRelocateTraits<CComPtr<T>> {
+public:
+    static constexpr bool bTriviallyRelocatable = true;
+};
+
+template <typename T, const IID* piid>
+class CSimpleRelocateTraits<CComQIPtr<T, piid>> {
+public:
+    static constexpr bool bTriviallyRelocatable = true;
+};
+
+template <>
+class CSimpleRelocateTraits<CComBSTR> {
+public:
+    static constexpr bool bTriviallyRelocatable = true;
+};
+
+template <>
+class CSimpleRelocateTraits<CComVariant> {
+public:
+    static constexpr bool bTriviallyRelocatable = true;
+};
+
 } // namespace ATL
 
 #endif // __ATLCOMCLI_H__
@@ -1,38 +1,526 @@
 // OpenATL - Clean-room ATL subset for WTL 10.0
-// String conversion macros
+// String conversion classes and macros
 
 #ifndef __ATLCONV_H__
 #define __ATLCONV_H__
 
 #pragma once
 
+#include "atldef.h"
+#include "atlutf8.h"
+
 #include <tchar.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <malloc.h>
+
+namespace ATL {
+
+///////////////////////////////////////////////////////////////////////////////
+// Conversion helpers
+//
+// The ANSI, OEM and UTF-8 code pages map 0x00-0x7F straight to the same
+// UTF-16 values, and none of their multibyte characters starts with such a
+// byte. A leading ASCII run is therefore copied directly; only the rest
+// goes through MultiByteToWideChar or WideCharToMultiByte, and pure ASCII
+// text never calls them at all. UTF-8 does not call them either: it goes
+// through the transcoder in atlutf8.h.
+
+inline UINT _AtlGetConversionACP() noexcept
+{
+#ifdef _CONVERSION_DONT_USE_THREAD_LOCALE
+    return CP_ACP;
+#else
+    return CP_THREAD_ACP;
+#endif
+}
+
+inline bool _AtlIsAsciiCodePage(UINT nCodePage) noexcept
+{
+    return nCodePage == CP_UTF8 || nCodePage == CP_ACP || nCodePage == CP_THREAD_ACP || nCodePage == CP_OEMCP;
+}
+
+// CP_ACP is UTF-8 too when the application manifest selects it as the
+// process ANSI code page. CP_THREAD_ACP, the default for the conversion
+// classes, follows the process code page in that case.
+inline bool _AtlIsUtf8CodePage(UINT nCodePage) noexcept
+{
+    return nCodePage == CP_UTF8 || ((nCodePage == CP_ACP || nCodePage == CP_THREAD_ACP) && ::GetACP() == CP_UTF8);
+}
+
+// Drop-in replacements for MultiByteToWideChar and WideCharToMultiByte
+// without flags. They take the same lengths, including -1 for a
+// NUL-terminated source and 0 for measuring, and fail the same way.
+inline int AtlMultiByteToWideChar(UINT nCodePage, LPCSTR psz, int nLength, LPWSTR pwsz, int nCapacity) noexcept
+{
+    if (!_AtlIsUtf8CodePage(nCodePage))
+        return ::MultiByteToWideChar(nCodePage, 0, psz, nLength, pwsz, nCapacity);
+    if (nLength < 0)
+        nLength = (int)strlen(psz) + 1;
+    if (nLength == 0) {
+        ::SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    int nResult = AtlUtf8ToUtf16(psz, nLength, pwsz, nCapacity);
+    if (nResult == 0)
+        ::SetLastError(ERROR_INSUFFICIENT_BUFFER);
+    return nResult;
+}
+
+inline int AtlWideCharToMultiByte(UINT nCodePage, LPCWSTR pwsz, int nLength, LPSTR psz, int nCapacity) noexcept
+{
+    if (!_AtlIsUtf8CodePage(nCodePage))
+        return ::WideCharToMultiByte(nCodePage, 0, pwsz, nLength, psz, nCapacity, NULL, NULL);
+    if (nLength < 0)
+        nLength = (int)wcslen(pwsz) + 1;
+    if (nLength == 0) {
+        ::SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    int nResult = AtlUtf16ToUtf8(pwsz, nLength, psz, nCapacity);
+    if (nResult == 0)
+        ::SetLastError(ERROR_INSUFFICIENT_BUFFER);
+    return nResult;
+}
+
+// Length of the leading run of ASCII characters
+inline int _AtlAsciiRunLength(LPCSTR psz, int nLength) noexcept
+{
+    int i = 0;
+    while (i < nLength && (BYTE)psz[i] < 0x80)
+        i++;
+    return i;
+}
+
+inline int _AtlAsciiRunLength(LPCWSTR psz, int nLength) noexcept
+{
+    int i = 0;
+    while (i < nLength && psz[i] < 0x80)
+        i++;
+    return i;
+}
+
+// Length of psz including the terminator
+inline int _AtlConvLength(LPCSTR psz)
+{
+    size_t nLength = strlen(psz);
+    if (nLength >= INT_MAX)
+        AtlThrow(E_OUTOFMEMORY);
+    return (int)nLength + 1;
+}
+
+inline int _AtlConvLength(LPCWSTR psz)
+{
+    size_t nLength = wcslen(psz);
+    if (nLength >= INT_MAX)
+        AtlThrow(E_OUTOFMEMORY);
+    return (int)nLength + 1;
+}
+
+// Converts nLength characters of psz into pwsz, which holds nCapacity.
+// Returns the number of characters written, or 0 on failure with the
+// reason in GetLastError. A nLength-character buffer always suffices.
+inline int _AtlConvertA2W(LPWSTR pwsz, int nCapacity, LPCSTR psz, int nLength, UINT nCodePage) noexcept
+{
+    ATLASSERT(nCapacity > 0 && nLength > 0);
+    if (_AtlIsUtf8CodePage(nCodePage))
+        return AtlMultiByteToWideChar(CP_UTF8, psz, nLength, pwsz, nCapacity);
+    int nLimit = (nLength < nCapacity) ? nLength : nCapacity;
+    int nAscii = _AtlIsAsciiCodePage(nCodePage) ? _AtlAsciiRunLength(psz, nLimit) : 0;
+    for (int i = 0; i < nAscii; i++)
+        pwsz[i] = (WCHAR)psz[i];
+    if (nAscii == nLength)
+        return nLength;
+    if (nAscii == nCapacity) {
+        ::SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+    }
+    int nRest = ::MultiByteToWideChar(nCodePage, 0, psz + nAscii, nLength - nAscii, pwsz + nAscii, nCapacity - nAscii);
+    return (nRest != 0) ? nAscii + nRest : 0;
+}
+
+inline int _AtlConvertW2A(LPSTR psz, int nCapacity, LPCWSTR pwsz, int nLength, UINT nCodePage) noexcept
+{
+    ATLASSERT(nCapacity > 0 && nLength > 0);
+    if (_AtlIsUtf8CodePage(nCodePage))
+        return AtlWideCharToMultiByte(CP_UTF8, pwsz, nLength, psz, nCapacity);
+    int nLimit = (nLength < nCapacity) ? nLength : nCapacity;
+    int nAscii = _AtlIsAsciiCodePage(nCodePage) ? _AtlAsciiRunLength(pwsz, nLimit) : 0;
+    for (int i = 0; i < nAscii; i++)
+        psz[i] = (char)pwsz[i];
+    if (nAscii == nLength)
+        return nLength;
+    if (nAscii == nCapacity) {
+        ::SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+    }
+    int nRest = ::WideCharToMultiByte(nCodePage, 0, pwsz + nAscii, nLength - nAscii, psz + nAscii, nCapacity - nAscii, NULL, NULL);
+    return (nRest != 0) ? nAscii + nRest : 0;
+}
+
+// Bytes needed to convert nLength characters of pwsz, or 0 on failure
+inline int _AtlW2ALength(LPCWSTR pwsz, int nLength, UINT nCodePage) noexcept
+{
+    if (_AtlIsUtf8CodePage(nCodePage))
+        return AtlWideCharToMultiByte(CP_UTF8, pwsz, nLength, NULL, 0);
+    int nAscii = _AtlIsAsciiCodePage(nCodePage) ? _AtlAsciiRunLength(pwsz, nLength) : 0;
+    if (nAscii == nLength)
+        return nLength;
+    int nRest = ::WideCharToMultiByte(nCodePage, 0, pwsz + nAscii, nLength - nAscii, NULL, 0, NULL, NULL);
+    if (nRest == 0 || nRest > INT_MAX - nAscii)
+        return 0;
+    return nAscii + nRest;
+}
+
+// Converts psz into pwszBuffer when it fits and into a heap block
+// otherwise. Free the result with _AtlConvFreeMemory.
+inline LPWSTR _AtlConvertA2WAlloc(LPCSTR psz, UINT nCodePage, LPWSTR pwszBuffer, int nBufferLength)
+{
+    int nLength = _AtlConvLength(psz);
+    LPWSTR pwsz = pwszBuffer;
+    if (nLength > nBufferLength) {
+        pwsz = (LPWSTR)malloc((size_t)nLength * sizeof(WCHAR));
+        if (pwsz == NULL) {
+            AtlThrow(E_OUTOFMEMORY);
+            return NULL;
+        }
+    }
+    if (_AtlConvertA2W(pwsz, nLength, psz, nLength, nCodePage) == 0) {
+        if (pwsz != pwszBuffer)
+            free(pwsz);
+        AtlThrowLastWin32();
+        return NULL;
+    }
+    return pwsz;
+}
+
+inline LPSTR _AtlConvertW2AAlloc(LPCWSTR pwsz, UINT nCodePage, LPSTR pszBuffer, int nBufferLength)
+{
+    int nLength = _AtlConvLength(pwsz);
+    if (_AtlConvertW2A(pszBuffer, nBufferLength, pwsz, nLength, nCodePage) != 0)
+        return pszBuffer;
+    int nNeeded = (::GetLastError() == ERROR_INSUFFICIENT_BUFFER) ? _AtlW2ALength(pwsz, nLength, nCodePage) : 0;
+    LPSTR psz = (nNeeded != 0) ? (LPSTR)malloc(nNeeded) : NULL;
+    if (psz == NULL) {
+        if (nNeeded != 0)
+            AtlThrow(E_OUTOFMEMORY);
+        else
+            AtlThrowLastWin32();
+        return NULL;
+    }
+    if (_AtlConvertW2A(psz, nNeeded, pwsz, nLength, nCodePage) == 0) {
+        free(psz);
+        AtlThrowLastWin32();
+        return NULL;
+    }
+    return psz;
+}
+
+template <typename T>
+inline T* _AtlConvCopyAlloc(const T* psz, T* pszBuffer, int nBufferLength)
+{
+    int nLength = _AtlConvLength(psz);
+    T* pszResult = pszBuffer;
+    if (nLength > nBufferLength) {
+        pszResult = (T*)malloc((size_t)nLength * sizeof(T));
+        if (pszResult == NULL) {
+            AtlThrow(E_OUTOFMEMORY);
+            return NULL;
+        }
+    }
+    memcpy(pszResult, psz, (size_t)nLength * sizeof(T));
+    return pszResult;
+}
+
+inline void _AtlConvFreeMemory(void* p, void* pBuffer) noexcept
+{
+    if (p != pBuffer)
+        free(p);
+}
+
+// Back the alloca-based macros below; nChars is the size of the output
+// buffer in characters. Return NULL if the conversion fails.
+inline LPWSTR WINAPI AtlA2WHelper(LPWSTR lpw, LPCSTR lpa, int nChars, UINT acp) noexcept
+{
+    ATLASSERT(lpa != NULL && lpw != NULL);
+    int nLength = (int)strlen(lpa) + 1;
+    return (_AtlConvertA2W(lpw, nChars, lpa, nLength, acp) != 0) ? lpw : NULL;
+}
+
+inline LPSTR WINAPI AtlW2AHelper(LPSTR lpa, LPCWSTR lpw, int nChars, UINT acp) noexcept
+{
+    ATLASSERT(lpw != NULL && lpa != NULL);
+    int nLength = (int)wcslen(lpw) + 1;
+    return (_AtlConvertW2A(lpa, nChars, lpw, nLength, acp) != 0) ? lpa : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CA2WEX / CW2AEX - conversion into an inline buffer
+//
+// The result lives in the object: up to t_nBufferLength characters
+// (terminator included) in the inline buffer, longer strings on the heap.
+// A NULL source gives a NULL result. Failures throw.
+//
+//     CA2W wszName(pszUtf8Name, CP_UTF8);
+//     ::SetWindowTextW(hWnd, wszName);
+
+template <int t_nBufferLength = 128>
+class CA2WEX {
+public:
+    CA2WEX(LPCSTR psz) : m_psz(m_szBuffer)
+    {
+        Init(psz, _AtlGetConversionACP());
+    }
+
+    CA2WEX(LPCSTR psz, UINT nCodePage) : m_psz(m_szBuffer)
+    {
+        Init(psz, nCodePage);
+    }
+
+    ~CA2WEX()
+    {
+        _AtlConvFreeMemory(m_psz, m_szBuffer);
+    }
+
+    operator LPWSTR() const noexcept
+    {
+        return m_psz;
+    }
+
+    LPWSTR m_psz;
+    WCHAR m_szBuffer[t_nBufferLength];
+
+private:
+    void Init(LPCSTR psz, UINT nCodePage)
+    {
+        m_psz = (psz != NULL) ? _AtlConvertA2WAlloc(psz, nCodePage, m_szBuffer, t_nBufferLength) : NULL;
+    }
+
+    CA2WEX(const CA2WEX&) = delete;
+    CA2WEX& operator=(const CA2WEX&) = delete;
+};
+
+template <int t_nBufferLength = 128>
+class CW2AEX {
+public:
+    CW2AEX(LPCWSTR psz) : m_psz(m_szBuffer)
+    {
+        Init(psz, _AtlGetConversionACP());
+    }
+
+    CW2AEX(LPCWSTR psz, UINT nCodePage) : m_psz(m_szBuffer)
+    {
+        Init(psz, nCodePage);
+    }
+
+    ~CW2AEX()
+    {
+        _AtlConvFreeMemory(m_psz, m_szBuffer);
+    }
+
+    operator LPSTR() const noexcept
+    {
+        return m_psz;
+    }
+
+    LPSTR m_psz;
+    char m_szBuffer[t_nBufferLength];
+
+private:
+    void Init(LPCWSTR psz, UINT nCodePage)
+    {
+        m_psz = (psz != NULL) ? _AtlConvertW2AAlloc(psz, nCodePage, m_szBuffer, t_nBufferLength) : NULL;
+    }
+
+    CW2AEX(const CW2AEX&) = delete;
+    CW2AEX& operator=(const CW2AEX&) = delete;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CA2AEX / CW2WEX - writable copy without conversion
 
-// Under UNICODE builds, TCHAR == WCHAR == OLECHAR, so conversions are identity.
-// Under MBCS builds, real conversion would be needed, but we only target UNICODE.
+template <int t_nBufferLength = 128>
+class CA2AEX {
+public:
+    CA2AEX(LPCSTR psz) : m_psz(m_szBuffer)
+    {
+        m_psz = (psz != NULL) ? _AtlConvCopyAlloc(psz, m_szBuffer, t_nBufferLength) : NULL;
+    }
+
+    CA2AEX(LPCSTR psz, UINT /*nCodePage*/) : CA2AEX(psz)
+    {
+    }
+
+    ~CA2AEX()
+    {
+        _AtlConvFreeMemory(m_psz, m_szBuffer);
+    }
+
+    operator LPSTR() const noexcept
+    {
+        return m_psz;
+    }
+
+    LPSTR m_psz;
+    char m_szBuffer[t_nBufferLength];
+
+private:
+    CA2AEX(const CA2AEX&) = delete;
+    CA2AEX& operator=(const CA2AEX&) = delete;
+};
+
+template <int t_nBufferLength = 128>
+class CW2WEX {
+public:
+    CW2WEX(LPCWSTR psz) : m_psz(m_szBuffer)
+    {
+        m_psz = (psz != NULL) ? _AtlConvCopyAlloc(psz, m_szBuffer, t_nBufferLength) : NULL;
+    }
+
+    CW2WEX(LPCWSTR psz, UINT /*nCodePage*/) : CW2WEX(psz)
+    {
+    }
+
+    ~CW2WEX()
+    {
+        _AtlConvFreeMemory(m_psz, m_szBuffer);
+    }
+
+    operator LPWSTR() const noexcept
+    {
+        return m_psz;
+    }
+
+    LPWSTR m_psz;
+    WCHAR m_szBuffer[t_nBufferLength];
+
+private:
+    CW2WEX(const CW2WEX&) = delete;
+    CW2WEX& operator=(const CW2WEX&) = delete;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CA2CAEX / CW2CWEX - read-only pass-through
+
+template <int t_nBufferLength = 128>
+class CA2CAEX {
+public:
+    CA2CAEX(LPCSTR psz) noexcept : m_psz(psz)
+    {
+    }
+
+    CA2CAEX(LPCSTR psz, UINT /*nCodePage*/) noexcept : m_psz(psz)
+    {
+    }
+
+    operator LPCSTR() const noexcept
+    {
+        return m_psz;
+    }
+
+    LPCSTR m_psz;
+
+private:
+    CA2CAEX(const CA2CAEX&) = delete;
+    CA2CAEX& operator=(const CA2CAEX&) = delete;
+};
+
+template <int t_nBufferLength = 128>
+class CW2CWEX {
+public:
+    CW2CWEX(LPCWSTR psz) noexcept : m_psz(psz)
+    {
+    }
+
+    CW2CWEX(LPCWSTR psz, UINT /*nCodePage*/) noexcept : m_psz(psz)
+    {
+    }
+
+    operator LPCWSTR() const noexcept
+    {
+        return m_psz;
+    }
+
+    LPCWSTR m_psz;
+
+private:
+    CW2CWEX(const CW2CWEX&) = delete;
+    CW2CWEX& operator=(const CW2CWEX&) = delete;
+};
+
+typedef CA2WEX<> CA2W;
+typedef CW2AEX<> CW2A;
+typedef CA2AEX<> CA2A;
+typedef CW2WEX<> CW2W;
+typedef CA2CAEX<> CA2CA;
+typedef CW2CWEX<> CW2CW;
+
+// Under UNICODE builds, TCHAR == WCHAR == OLECHAR.
+// MBCS is not a target for this library.
+
+#ifdef UNICODE
+
+typedef CA2W CA2T;
+typedef CA2W CA2CT;
+typedef CW2A CT2A;
+typedef CW2A CT2CA;
+typedef CW2W CT2W;
+typedef CW2CW CT2CW;
+typedef CW2W CW2T;
+typedef CW2CW CW2CT;
+
+typedef CW2W CT2OLE;
+typedef CW2CW CT2COLE;
+typedef CW2W COLE2T;
+typedef CW2CW COLE2CT;
+
+#endif // UNICODE
+
+} // namespace ATL
+
+///////////////////////////////////////////////////////////////////////////////
+// USES_CONVERSION macros
+//
+// The result is allocated with _alloca and lives until the calling
+// function returns, so do not use these in loops or on long strings; the
+// CA2W family above frees its memory at the end of the scope instead.
 
 #ifdef UNICODE
 
-#define USES_CONVERSION  int _convert = 0; (void)_convert; LPCWSTR _lpw = NULL; (void)_lpw; LPCSTR _lpa = NULL; (void)_lpa
+#define USES_CONVERSION  int _convert = 0; (void)_convert; UINT _acp = ATL::_AtlGetConversionACP(); (void)_acp; \
+    LPCWSTR _lpw = NULL; (void)_lpw; LPCSTR _lpa = NULL; (void)_lpa
+
+// Multibyte text needs at most one UTF-16 character per byte
+#define A2W(lpa) (((_lpa = (lpa)) == NULL) ? NULL : \
+    (_convert = ATL::_AtlConvLength(_lpa), \
+     ATL::AtlA2WHelper((LPWSTR)_alloca((size_t)_convert * sizeof(WCHAR)), _lpa, _convert, _acp)))
+
+#define W2A(lpw) (((_lpw = (lpw)) == NULL) ? NULL : \
+    ((_convert = ATL::_AtlW2ALength(_lpw, ATL::_AtlConvLength(_lpw), _acp)) == 0) ? NULL : \
+     ATL::AtlW2AHelper((LPSTR)_alloca((size_t)_convert), _lpw, _convert, _acp))
+
+#define A2CW(lpa)  ((LPCWSTR)A2W(lpa))
+#define W2CA(lpw)  ((LPCSTR)W2A(lpw))
 
 // T (TCHAR) <-> W (WCHAR) - identity under UNICODE
 #define T2W(lp)    (lp)
 #define W2T(lp)    (lp)
 #define T2CW(lp)   ((LPCWSTR)(lp))
-#define CW2T(lp)   ((LPCTSTR)(lp))
+#define W2CT(lp)   ((LPCTSTR)(lp))
 
-// T (TCHAR) <-> A (CHAR) - conversion under UNICODE
-#define T2A(lp)    ((LPSTR)(lp))   // Simplified: assume caller handles correctly
-#define A2T(lp)    ((LPTSTR)(lp))
+// T (TCHAR) <-> A (CHAR)
+#define T2A(lp)    W2A(lp)
+#define A2T(lp)    A2W(lp)
+#define T2CA(lp)   W2CA(lp)
+#define A2CT(lp)   A2CW(lp)
 
 // T (TCHAR) <-> OLE (OLECHAR == WCHAR) - identity under UNICODE
 #define T2OLE(lp)   ((LPOLESTR)(lp))
 #define OLE2T(lp)   ((LPTSTR)(lp))
 #define T2COLE(lp)  ((LPCOLESTR)(lp))
 #define OLE2CT(lp)  ((LPCTSTR)(lp))
-#define CT2OLE(lp)  ((LPOLESTR)(lp))
-#define CT2COLE(lp) ((LPCOLESTR)(lp))
-#define OLE2CT(lp)  ((LPCTSTR)(lp))
 
 // W <-> OLE - identity (both WCHAR)
 #define W2OLE(lp)   (lp)
@@ -40,17 +528,11 @@
 #define W2COLE(lp)  ((LPCOLESTR)(lp))
 #define OLE2CW(lp)  ((LPCWSTR)(lp))
 
-// A <-> W
-#define A2W(lp)    ((LPWSTR)(lp))
-#define W2A(lp)    ((LPSTR)(lp))
-#define A2CW(lp)   ((LPCWSTR)(lp))
-#define CW2A(lp)   ((LPSTR)(lp))
-
 // A <-> OLE
 #define A2OLE(lp)   A2W(lp)
 #define OLE2A(lp)   W2A(lp)
 #define A2COLE(lp)  A2CW(lp)
-#define OLE2CA(lp)  W2A(lp)
+#define OLE2CA(lp)  W2CA(lp)
 
 #else // !UNICODE (MBCS)
 
@@ -9,6 +9,9 @@
 #include "atldef.h"
 #include "atltrace.h"
 
+#include <atomic>
+#include <cstdlib>
+
 namespace ATL {
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -134,50 +137,257 @@ struct ATLSTRINGRESOURCEIMAGE {
 };
 #pragma pack(pop)
 
-inline const ATLSTRINGRESOURCEIMAGE* AtlGetStringResourceImage(
-    HINSTANCE hInstance, UINT id) noexcept
+// Finds string block wBlock and records where each of its 16 strings
+// starts. Strings that would run past the end of the block are left NULL.
+inline bool _AtlLoadStringResourceBlock(HINSTANCE hInstance, WORD wBlock, WORD wLanguage,
+    const ATLSTRINGRESOURCEIMAGE** apImages) noexcept
 {
-    HRSRC hResource = ::FindResourceW(hInstance, MAKEINTRESOURCEW(((id >> 4) + 1)), (LPWSTR)RT_STRING);
+    for (UINT x = 0; x < 16; x++)
+        apImages[x] = NULL;
+
+    HRSRC hResource = ::FindResourceExW(hInstance, (LPWSTR)RT_STRING, MAKEINTRESOURCEW(wBlock), wLanguage);
     if (hResource == NULL)
-        return NULL;
+        return false;
 
     HGLOBAL hGlobal = ::LoadResource(hInstance, hResource);
     if (hGlobal == NULL)
-        return NULL;
+        return false;
+
+    const BYTE* pbData = (const BYTE*)::LockResource(hGlobal);
+    if (pbData == NULL)
+        return false;
+
+    const BYTE* pbEnd = pbData + ::SizeofResource(hInstance, hResource);
+    for (UINT x = 0; x < 16; x++) {
+        if ((size_t)(pbEnd - pbData) < sizeof(ATLSTRINGRESOURCEIMAGE))
+            break;
+        const ATLSTRINGRESOURCEIMAGE* pImage = (const ATLSTRINGRESOURCEIMAGE*)pbData;
+        size_t cbImage = sizeof(ATLSTRINGRESOURCEIMAGE) + (pImage->nLength * sizeof(WCHAR));
+        if (cbImage > (size_t)(pbEnd - pbData))
+            break;
+        apImages[x] = pImage;
+        pbData += cbImage;
+    }
+    return true;
+}
 
-    const ATLSTRINGRESOURCEIMAGE* pImage = (const ATLSTRINGRESOURCEIMAGE*)::LockResource(hGlobal);
-    if (pImage == NULL)
-        return NULL;
+///////////////////////////////////////////////////////////////////////////////
+// CAtlStringResourceCache - index of string resource blocks
+//
+// String resources are stored in blocks of 16. The first lookup of any ID
+// in a block finds the block once and records where each string starts;
+// later lookups are a hash probe and an array index. Blocks that do not
+// exist are recorded as well. Entries are published with a single
+// compare-exchange, so readers take no lock.
+//
+// Preload fills the index for every block of a module in a list of
+// languages with one pass over the module's string table, so that startup
+// localization does no per-ID resource searches at all.
+//
+// The index holds pointers into the module's image. Flush drops a module's
+// entries; call it before the module is freed, since another module may
+// later be mapped at the same address. Flushed entries are kept until the
+// index is destroyed, because other threads may still be reading them.
+// FindResourceEx resolves language 0 through the thread UI language, so
+// those entries are also keyed on the UI language of the looking-up thread.
+
+class CAtlStringResourceCache {
+public:
+    CAtlStringResourceCache() noexcept = default;
 
-    UINT iIndex = id & 0x000F;
-    for (UINT x = 0; x < iIndex; x++) {
-        pImage = (const ATLSTRINGRESOURCEIMAGE*)(((const BYTE*)pImage) + (sizeof(ATLSTRINGRESOURCEIMAGE) + (pImage->nLength * sizeof(WCHAR))));
+    ~CAtlStringResourceCache()
+    {
+        for (UINT i = 0; i < _nSlots; i++) {
+            _Block* pBlock = m_apSlots[i].exchange(NULL, std::memory_order_relaxed);
+            if (pBlock != BlockRemoved())
+                free(pBlock);
+        }
+        _Block* pBlock = m_pRetired.exchange(NULL, std::memory_order_relaxed);
+        while (pBlock != NULL) {
+            _Block* pNext = pBlock->pNextRetired;
+            free(pBlock);
+            pBlock = pNext;
+        }
     }
 
-    return pImage;
-}
+    CAtlStringResourceCache(const CAtlStringResourceCache&) = delete;
+    CAtlStringResourceCache& operator=(const CAtlStringResourceCache&) = delete;
 
-inline const ATLSTRINGRESOURCEIMAGE* AtlGetStringResourceImage(
-    HINSTANCE hInstance, UINT id, WORD wLanguage) noexcept
-{
-    HRSRC hResource = ::FindResourceExW(hInstance, (LPWSTR)RT_STRING, MAKEINTRESOURCEW(((id >> 4) + 1)), wLanguage);
-    if (hResource == NULL)
-        return NULL;
+    const ATLSTRINGRESOURCEIMAGE* Lookup(HINSTANCE hInstance, UINT id, WORD wLanguage) noexcept
+    {
+        WORD wBlock = (WORD)((id >> 4) + 1);
+        const _Block* pBlock = FindBlock(hInstance, wBlock, wLanguage);
+        if (pBlock != NULL)
+            return pBlock->apImages[id & 0x000F];
+
+        // Out of memory or out of slots
+        const ATLSTRINGRESOURCEIMAGE* apImages[16];
+        _AtlLoadStringResourceBlock(hInstance, wBlock, wLanguage, apImages);
+        return apImages[id & 0x000F];
+    }
 
-    HGLOBAL hGlobal = ::LoadResource(hInstance, hResource);
-    if (hGlobal == NULL)
-        return NULL;
+    // Drops every entry of hInstance
+    void Flush(HINSTANCE hInstance) noexcept
+    {
+        for (UINT i = 0; i < _nSlots; i++) {
+            _Block* pBlock = m_apSlots[i].load(std::memory_order_acquire);
+            if (pBlock == NULL || pBlock == BlockRemoved() || pBlock->hInstance != hInstance)
+                continue;
+            if (m_apSlots[i].compare_exchange_strong(pBlock, BlockRemoved(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                _Block* pHead = m_pRetired.load(std::memory_order_relaxed);
+                do {
+                    pBlock->pNextRetired = pHead;
+                } while (!m_pRetired.compare_exchange_weak(pHead, pBlock, std::memory_order_release, std::memory_order_relaxed));
+            }
+        }
+    }
 
-    const ATLSTRINGRESOURCEIMAGE* pImage = (const ATLSTRINGRESOURCEIMAGE*)::LockResource(hGlobal);
-    if (pImage == NULL)
+    // Returns the number of blocks found
+    int Preload(HINSTANCE hInstance, const WORD* pwLanguages, int nLanguages) noexcept
+    {
+        ATLASSERT(pwLanguages != NULL || nLanguages == 0);
+        _PreloadContext context = { this, pwLanguages, nLanguages, 0 };
+        ::EnumResourceNamesW(hInstance, (LPCWSTR)RT_STRING, PreloadProc, (LONG_PTR)&context);
+        return context.nFound;
+    }
+
+private:
+    struct _Block {
+        HINSTANCE hInstance;
+        WORD wBlock;
+        WORD wLanguage;
+        WORD wUILanguage;   // thread UI language when wLanguage is 0
+        bool bFound;
+        const ATLSTRINGRESOURCEIMAGE* apImages[16];
+        _Block* pNextRetired;
+    };
+
+    struct _PreloadContext {
+        CAtlStringResourceCache* pThis;
+        const WORD* pwLanguages;
+        int nLanguages;
+        int nFound;
+    };
+
+    // Room for a few thousand strings in several languages
+    static const UINT _nSlots = 4096;       // power of two
+    static const UINT _nMaxProbe = 32;
+
+    std::atomic<_Block*> m_apSlots[_nSlots] = {};
+    std::atomic<_Block*> m_pRetired = {};   // flushed blocks
+
+    // Marks a flushed slot. Probes continue past it, and it may be reused.
+    static _Block* BlockRemoved() noexcept
+    {
+        return (_Block*)(UINT_PTR)1;
+    }
+
+    static UINT Hash(HINSTANCE hInstance, WORD wBlock, WORD wLanguage) noexcept
+    {
+        // Module handles are 64K aligned
+        UINT nHash = (UINT)((UINT_PTR)hInstance >> 16);
+        nHash = (nHash ^ ((UINT)wLanguage << 16) ^ wBlock) * 0x9E3779B1u;
+        return nHash ^ (nHash >> 15);
+    }
+
+    static bool IsBlockOf(const _Block* pBlock, HINSTANCE hInstance, WORD wBlock, WORD wLanguage, WORD wUILanguage) noexcept
+    {
+        return pBlock->hInstance == hInstance && pBlock->wBlock == wBlock &&
+            pBlock->wLanguage == wLanguage && pBlock->wUILanguage == wUILanguage;
+    }
+
+    const _Block* FindBlock(HINSTANCE hInstance, WORD wBlock, WORD wLanguage) noexcept
+    {
+        WORD wUILanguage = (wLanguage == 0) ? (WORD)::GetThreadUILanguage() : 0;
+        UINT nHash = Hash(hInstance, wBlock, wLanguage | wUILanguage);
+
+        // Search the whole chain first: the block may sit past a removed
+        // slot, and claiming that slot would index it twice
+        UINT iFree = _nMaxProbe;
+        for (UINT i = 0; i < _nMaxProbe; i++) {
+            _Block* pBlock = m_apSlots[(nHash + i) & (_nSlots - 1)].load(std::memory_order_acquire);
+            if (pBlock == NULL) {
+                if (iFree == _nMaxProbe)
+                    iFree = i;
+                break;
+            }
+            if (pBlock == BlockRemoved()) {
+                if (iFree == _nMaxProbe)
+                    iFree = i;
+            } else if (IsBlockOf(pBlock, hInstance, wBlock, wLanguage, wUILanguage)) {
+                return pBlock;
+            }
+        }
+
+        // Not indexed yet: claim the first free slot on the chain
+        _Block* pNew = NULL;
+        for (UINT i = iFree; i < _nMaxProbe; i++) {
+            std::atomic<_Block*>& slot = m_apSlots[(nHash + i) & (_nSlots - 1)];
+            _Block* pBlock = slot.load(std::memory_order_acquire);
+            if (pBlock == NULL || pBlock == BlockRemoved()) {
+                if (pNew == NULL) {
+                    pNew = (_Block*)malloc(sizeof(_Block));
+                    if (pNew == NULL)
+                        return NULL;
+                    pNew->hInstance = hInstance;
+                    pNew->wBlock = wBlock;
+                    pNew->wLanguage = wLanguage;
+                    pNew->wUILanguage = wUILanguage;
+                    pNew->bFound = _AtlLoadStringResourceBlock(hInstance, wBlock, wLanguage, pNew->apImages);
+                    pNew->pNextRetired = NULL;
+                }
+                if (slot.compare_exchange_strong(pBlock, pNew, std::memory_order_acq_rel, std::memory_order_acquire))
+                    return pNew;
+                // Another thread changed the slot; pBlock is what it stored
+                if (pBlock == BlockRemoved())
+                    continue;
+            }
+            if (IsBlockOf(pBlock, hInstance, wBlock, wLanguage, wUILanguage)) {
+                free(pNew);
+                return pBlock;
+            }
+        }
+        free(pNew);
         return NULL;
+    }
 
-    UINT iIndex = id & 0x000F;
-    for (UINT x = 0; x < iIndex; x++) {
-        pImage = (const ATLSTRINGRESOURCEIMAGE*)(((const BYTE*)pImage) + (sizeof(ATLSTRINGRESOURCEIMAGE) + (pImage->nLength * sizeof(WCHAR))));
+    static BOOL CALLBACK PreloadProc(HMODULE hModule, LPCWSTR /*lpType*/, LPWSTR lpName, LONG_PTR lParam) noexcept
+    {
+        _PreloadContext* pContext = (_PreloadContext*)lParam;
+        if (!IS_INTRESOURCE(lpName))
+            return TRUE;
+        for (int i = 0; i < pContext->nLanguages; i++) {
+            const _Block* pBlock = pContext->pThis->FindBlock((HINSTANCE)hModule, (WORD)(UINT_PTR)lpName, pContext->pwLanguages[i]);
+            if (pBlock == NULL)
+                return FALSE;       // the index is full
+            if (pBlock->bFound)
+                pContext->nFound++;
+        }
+        return TRUE;
     }
+};
+
+__declspec(selectany) CAtlStringResourceCache _AtlStringResourceCache;
+
+// Forgets the string resources indexed for hInstance. Call it before
+// freeing a module whose strings were loaded.
+inline void AtlFlushStringResourceCache(HINSTANCE hInstance) noexcept
+{
+    _AtlStringResourceCache.Flush(hInstance);
+}
+
+// Both overloads return NULL when the string's block is missing or
+// malformed; a missing string inside an existing block has nLength == 0.
+inline const ATLSTRINGRESOURCEIMAGE* AtlGetStringResourceImage(
+    HINSTANCE hInstance, UINT id) noexcept
+{
+    return _AtlStringResourceCache.Lookup(hInstance, id, 0);
+}
 
-    return pImage;
+inline const ATLSTRINGRESOURCEIMAGE* AtlGetStringResourceImage(
+    HINSTANCE hInstance, UINT id, WORD wLanguage) noexcept
+{
+    return _AtlStringResourceCache.Lookup(hInstance, id, wLanguage);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -220,6 +430,14 @@ public:
     {
         HINSTANCE hOld = m_hInstResource;
         m_hInstResource = hInst;
+        if (hInst != hOld) {
+            // The old resource module is usually freed next, and the new one
+            // may be mapped where a freed module's strings were indexed
+            if (hOld != m_hInst)
+                AtlFlushStringResourceCache(hOld);
+            if (hInst != m_hInst)
+                AtlFlushStringResourceCache(hInst);
+        }
         return hOld;
     }
 };
@@ -238,6 +456,57 @@ inline HINSTANCE AtlFindStringResourceInstance(UINT nID, WORD wLanguage = 0) noe
     return _AtlBaseModule.GetModuleInstance();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// String resource views
+//
+// These point straight into the module's string table. Reading a string
+// for display then needs no allocation or copy. The text is not
+// NUL-terminated and stays valid while the module is loaded.
+
+// Points *ppch at string id and returns its length. Returns 0 and sets
+// *ppch to NULL if the string is missing or empty.
+inline int AtlGetStringResourceView(HINSTANCE hInstance, UINT id, LPCWSTR* ppch, WORD wLanguage = 0) noexcept
+{
+    ATLASSERT(ppch != NULL);
+    const ATLSTRINGRESOURCEIMAGE* pImage = AtlGetStringResourceImage(hInstance, id, wLanguage);
+    if (pImage == NULL || pImage->nLength == 0) {
+        *ppch = NULL;
+        return 0;
+    }
+    *ppch = pImage->achString;
+    return pImage->nLength;
+}
+
+// Tries each language in turn
+inline int AtlGetStringResourceView(HINSTANCE hInstance, UINT id, LPCWSTR* ppch,
+    const WORD* pwLanguages, int nLanguages) noexcept
+{
+    for (int i = 0; i < nLanguages; i++) {
+        int nLength = AtlGetStringResourceView(hInstance, id, ppch, pwLanguages[i]);
+        if (nLength != 0)
+            return nLength;
+    }
+    *ppch = NULL;
+    return 0;
+}
+
+// Looks in the resource instance, then in the module instance
+inline int AtlGetStringResourceView(UINT id, LPCWSTR* ppch, WORD wLanguage = 0) noexcept
+{
+    int nLength = AtlGetStringResourceView(_AtlBaseModule.GetResourceInstance(), id, ppch, wLanguage);
+    if (nLength == 0 && _AtlBaseModule.GetModuleInstance() != _AtlBaseModule.GetResourceInstance())
+        nLength = AtlGetStringResourceView(_AtlBaseModule.GetModuleInstance(), id, ppch, wLanguage);
+    return nLength;
+}
+
+// Indexes every string table block of hInstance in each language of the
+// chain, for example { user language, LANG_ENGLISH, 0 }. Returns the number
+// of blocks found.
+inline int AtlPreloadStringResources(HINSTANCE hInstance, const WORD* pwLanguages, int nLanguages) noexcept
+{
+    return _AtlStringResourceCache.Preload(hInstance, pwLanguages, nLanguages);
+}
+
 } // namespace ATL
 
 #endif // __ATLCORE_H__
@@ -128,6 +128,13 @@ public:
 }
 #endif
 
+#ifndef AtlThrowLastWin32
+[[noreturn]] inline void AtlThrowLastWin32()
+{
+    AtlThrow(HRESULT_FROM_WIN32(::GetLastError()));
+}
+#endif
+
 } // namespace ATL
 
 #ifndef ATLTRY
@@ -165,6 +172,13 @@ inline void AtlThrow(HRESULT hr)
 }
 #endif
 
+#ifndef AtlThrowLastWin32
+inline void AtlThrowLastWin32()
+{
+    AtlThrow(HRESULT_FROM_WIN32(::GetLastError()));
+}
+#endif
+
 } // namespace ATL
 
 #ifndef ATLTRY
@@ -10,6 +10,18 @@
 
 #include <new>
 #include <cstring>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#if defined(_M_AMD64) || defined(__x86_64__) || defined(__amd64__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
 
 namespace ATL {
 
@@ -35,6 +47,295 @@ public:
     }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleRelocateTraits - can elements be moved with realloc / memmove?
+//
+// The simple collections grow with realloc and close gaps with memmove,
+// which is only valid for types whose objects may be moved bit for bit.
+// That is assumed for trivially copyable types. Other types are moved by
+// move construction unless they specialize this trait. COM smart pointers
+// do this in atlcomcli.h.
+
+template <typename T>
+class CSimpleRelocateTraits {
+public:
+    static constexpr bool bTriviallyRelocatable = std::is_trivially_copyable<T>::value;
+};
+
+// Reallocates an array holding nSize constructed elements to nNewAllocSize
+// slots. Returns NULL on failure, leaving the old array untouched.
+template <typename T>
+inline T* AtlSimpleRelocate(T* pOld, int nSize, int nNewAllocSize)
+{
+    if constexpr (CSimpleRelocateTraits<T>::bTriviallyRelocatable) {
+        return (T*)realloc((void*)pOld, nNewAllocSize * sizeof(T));
+    } else {
+        T* pNew = (T*)malloc(nNewAllocSize * sizeof(T));
+        if (pNew == NULL)
+            return NULL;
+        for (int i = 0; i < nSize; i++) {
+            ::new (&pNew[i]) T(std::move(pOld[i]));
+            pOld[i].~T();
+        }
+        free(pOld);
+        return pNew;
+    }
+}
+
+// Moves the element at pSrc into the destroyed slot pDst; pSrc is left destroyed
+template <typename T>
+inline void AtlSimpleRelocateOne(T* pDst, T* pSrc)
+{
+    if constexpr (CSimpleRelocateTraits<T>::bTriviallyRelocatable) {
+        memcpy((void*)pDst, (const void*)pSrc, sizeof(T));
+    } else {
+        ::new (pDst) T(std::move(*pSrc));
+        pSrc->~T();
+    }
+}
+
+// Closes the gap left by the destroyed element at nIndex in an array that
+// held nSize elements
+template <typename T>
+inline void AtlSimpleCloseGap(T* p, int nIndex, int nSize)
+{
+    if constexpr (CSimpleRelocateTraits<T>::bTriviallyRelocatable) {
+        if (nIndex != (nSize - 1))
+            memmove((void*)&p[nIndex], (const void*)&p[nIndex + 1], (nSize - nIndex - 1) * sizeof(T));
+    } else {
+        for (int i = nIndex; i < nSize - 1; i++)
+            AtlSimpleRelocateOne(&p[i], &p[i + 1]);
+    }
+}
+
+// Opens a gap at nIndex in an array that holds nSize elements and has room
+// for one more; the slot at nIndex is left unconstructed
+template <typename T>
+inline void AtlSimpleOpenGap(T* p, int nIndex, int nSize)
+{
+    if constexpr (CSimpleRelocateTraits<T>::bTriviallyRelocatable) {
+        if (nIndex != nSize)
+            memmove((void*)&p[nIndex + 1], (const void*)&p[nIndex], (nSize - nIndex) * sizeof(T));
+    } else {
+        for (int i = nSize; i > nIndex; i--)
+            AtlSimpleRelocateOne(&p[i], &p[i - 1]);
+    }
+}
+
+// Destroys the elements for which pred returns true and slides the rest
+// down in one pass, keeping their order. Returns the new size.
+template <typename T, typename TPred>
+inline int AtlSimpleRemoveIf(T* p, int nSize, TPred pred)
+{
+    int nKept = 0;
+    for (int i = 0; i < nSize; i++) {
+        if (pred(p[i])) {
+            p[i].~T();
+        } else {
+            if (i != nKept)
+                AtlSimpleRelocateOne(&p[nKept], &p[i]);
+            nKept++;
+        }
+    }
+    return nKept;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Vectorized Find for integral and pointer elements
+//
+// CSimpleArray::Find and CSimpleMap::FindKey / FindVal compare one element
+// at a time through TEqual. When TEqual is the default helper and the
+// element is an integer, enum or pointer, equality is bitwise and the scan
+// compares 16 bytes per step with SSE2, or 32 with AVX2 when the compiler
+// targets it (/arch:AVX2, -mavx2). Other targets and types keep the scalar
+// loop.
+
+#if defined(_M_AMD64) || defined(__x86_64__) || defined(__amd64__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define _ATL_SIMPLE_FIND_SSE2
+#endif
+
+template <typename T, typename TEqual>
+class CSimpleFindTraits {
+public:
+    static constexpr bool bVectorizable =
+        std::is_same<TEqual, CSimpleArrayEqualHelper<T>>::value &&
+        (std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value) &&
+        (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+};
+
+#ifdef _ATL_SIMPLE_FIND_SSE2
+
+inline int _AtlSimpleLowestBit(unsigned int nMask) noexcept
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(nMask);
+#else
+    unsigned long nIndex;
+    _BitScanForward(&nIndex, nMask);
+    return (int)nIndex;
+#endif
+}
+
+// Lane-wise equality of two vectors, as a byte mask per matching element
+template <int t_nSize>
+inline __m128i _AtlSimpleCompare128(__m128i a, __m128i b) noexcept
+{
+    if constexpr (t_nSize == 1) {
+        return _mm_cmpeq_epi8(a, b);
+    } else if constexpr (t_nSize == 2) {
+        return _mm_cmpeq_epi16(a, b);
+    } else if constexpr (t_nSize == 4) {
+        return _mm_cmpeq_epi32(a, b);
+    } else {
+        // SSE2 has no 64-bit compare: both 32-bit halves must match
+        __m128i c = _mm_cmpeq_epi32(a, b);
+        return _mm_and_si128(c, _mm_shuffle_epi32(c, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+}
+
+#ifdef __AVX2__
+template <int t_nSize>
+inline __m256i _AtlSimpleCompare256(__m256i a, __m256i b) noexcept
+{
+    if constexpr (t_nSize == 1) {
+        return _mm256_cmpeq_epi8(a, b);
+    } else if constexpr (t_nSize == 2) {
+        return _mm256_cmpeq_epi16(a, b);
+    } else if constexpr (t_nSize == 4) {
+        return _mm256_cmpeq_epi32(a, b);
+    } else {
+        return _mm256_cmpeq_epi64(a, b);
+    }
+}
+#endif
+
+// p is only read through vector loads and memcpy, so any element type of
+// the same width may be searched as TBits
+template <typename TBits>
+inline int _AtlSimpleFindBits(const void* pData, int nSize, TBits bits) noexcept
+{
+    const BYTE* p = (const BYTE*)pData;
+    const int nSizeOf = (int)sizeof(TBits);
+    int i = 0;
+
+#ifdef __AVX2__
+    const int nPerVector256 = 32 / nSizeOf;
+    __m256i vKey256;
+    if constexpr (nSizeOf == 1)
+        vKey256 = _mm256_set1_epi8((char)bits);
+    else if constexpr (nSizeOf == 2)
+        vKey256 = _mm256_set1_epi16((short)bits);
+    else if constexpr (nSizeOf == 4)
+        vKey256 = _mm256_set1_epi32((int)bits);
+    else
+        vKey256 = _mm256_set1_epi64x((long long)bits);
+    for (; i + nPerVector256 <= nSize; i += nPerVector256) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i * nSizeOf));
+        unsigned int nMask = (unsigned int)_mm256_movemask_epi8(_AtlSimpleCompare256<nSizeOf>(v, vKey256));
+        if (nMask != 0)
+            return i + _AtlSimpleLowestBit(nMask) / nSizeOf;
+    }
+#endif
+
+    const int nPerVector = 16 / nSizeOf;
+    __m128i vKey;
+    if constexpr (nSizeOf == 1)
+        vKey = _mm_set1_epi8((char)bits);
+    else if constexpr (nSizeOf == 2)
+        vKey = _mm_set1_epi16((short)bits);
+    else if constexpr (nSizeOf == 4)
+        vKey = _mm_set1_epi32((int)bits);
+    else
+        vKey = _mm_set_epi32((int)(bits >> 32), (int)bits, (int)(bits >> 32), (int)bits);
+    for (; i + nPerVector <= nSize; i += nPerVector) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i * nSizeOf));
+        unsigned int nMask = (unsigned int)_mm_movemask_epi8(_AtlSimpleCompare128<nSizeOf>(v, vKey));
+        if (nMask != 0)
+            return i + _AtlSimpleLowestBit(nMask) / nSizeOf;
+    }
+
+    for (; i < nSize; i++) {
+        TBits element;
+        memcpy(&element, p + i * nSizeOf, sizeof(TBits));
+        if (element == bits)
+            return i;
+    }
+    return -1;
+}
+
+#endif // _ATL_SIMPLE_FIND_SSE2
+
+// Returns the index of the first element of p[0, nSize) equal to t, or -1
+template <typename T, typename TEqual = CSimpleArrayEqualHelper<T>>
+inline int AtlSimpleFind(const T* p, int nSize, const T& t)
+{
+#ifdef _ATL_SIMPLE_FIND_SSE2
+    if constexpr (CSimpleFindTraits<T, TEqual>::bVectorizable) {
+        // Search the elements as unsigned integers of the same width
+        typedef typename std::conditional<sizeof(T) == 1, unsigned char,
+            typename std::conditional<sizeof(T) == 2, unsigned short,
+            typename std::conditional<sizeof(T) == 4, unsigned int, unsigned long long>::type>::type>::type TBits;
+        TBits bits;
+        memcpy(&bits, &t, sizeof(T));
+        return _AtlSimpleFindBits(p, nSize, bits);
+    } else
+#endif
+    {
+        for (int i = 0; i < nSize; i++) {
+            if (TEqual::IsEqual(p[i], t))
+                return i;
+        }
+        return -1;
+    }
+}
+
+// Removes every element of p[0, nSize) that equals one of pItems[0, nCount)
+// in a single compaction pass. pItems may point into p. Returns the new
+// size, or nSize when a needed copy of pItems cannot be allocated.
+template <typename T, typename TEqual = CSimpleArrayEqualHelper<T>>
+inline int AtlSimpleRemoveItems(T* p, int nSize, const T* pItems, int nCount)
+{
+    if (nCount <= 0)
+        return nSize;
+
+    if constexpr (CSimpleFindTraits<T, TEqual>::bVectorizable) {
+        // Large batches of integers and pointers: sort a copy once and
+        // binary-search it. std::less orders any pointers.
+        if (nCount > 32) {
+            T* aSorted = (T*)malloc(nCount * sizeof(T));
+            if (aSorted != NULL) {
+                memcpy((void*)aSorted, (const void*)pItems, nCount * sizeof(T));
+                std::sort(aSorted, aSorted + nCount, std::less<T>());
+                int nNewSize = AtlSimpleRemoveIf(p, nSize,
+                    [=](const T& t) { return std::binary_search(aSorted, aSorted + nCount, t, std::less<T>()); });
+                free(aSorted);
+                return nNewSize;
+            }
+        }
+    }
+
+    // The pass destroys and relocates elements of p, so items that overlap
+    // it are searched in a copy
+    std::less<const T*> less;
+    if (less(pItems, p + nSize) && less(p, pItems + nCount)) {
+        T* aCopy = (T*)malloc(nCount * sizeof(T));
+        if (aCopy == NULL)
+            return nSize;
+        for (int i = 0; i < nCount; i++)
+            ::new (&aCopy[i]) T(pItems[i]);
+        int nNewSize = AtlSimpleRemoveIf(p, nSize,
+            [=](const T& t) { return AtlSimpleFind<T, TEqual>(aCopy, nCount, t) >= 0; });
+        for (int i = 0; i < nCount; i++)
+            aCopy[i].~T();
+        free(aCopy);
+        return nNewSize;
+    }
+
+    return AtlSimpleRemoveIf(p, nSize,
+        [=](const T& t) { return AtlSimpleFind<T, TEqual>(pItems, nCount, t) >= 0; });
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CSimpleArray
 
@@ -51,14 +352,15 @@ public:
 
     CSimpleArray(const CSimpleArray<T, TEqual>& src) : m_aT(NULL), m_nSize(0), m_nAllocSize(0)
     {
-        if (src.GetSize()) {
-            m_aT = (T*)calloc(src.GetSize(), sizeof(T));
-            if (m_aT != NULL) {
-                m_nAllocSize = src.GetSize();
-                for (int i = 0; i < src.GetSize(); i++)
-                    Add(src[i]);
-            }
-        }
+        CopyFrom(src);
+    }
+
+    CSimpleArray(CSimpleArray<T, TEqual>&& src) noexcept
+        : m_aT(src.m_aT), m_nSize(src.m_nSize), m_nAllocSize(src.m_nAllocSize)
+    {
+        src.m_aT = NULL;
+        src.m_nSize = 0;
+        src.m_nAllocSize = 0;
     }
 
     ~CSimpleArray()
@@ -70,14 +372,21 @@ public:
     {
         if (this != &src) {
             RemoveAll();
-            if (src.GetSize()) {
-                m_aT = (T*)calloc(src.GetSize(), sizeof(T));
-                if (m_aT != NULL) {
-                    m_nAllocSize = src.GetSize();
-                    for (int i = 0; i < src.GetSize(); i++)
-                        Add(src[i]);
-                }
-            }
+            CopyFrom(src);
+        }
+        return *this;
+    }
+
+    CSimpleArray<T, TEqual>& operator=(CSimpleArray<T, TEqual>&& src) noexcept
+    {
+        if (this != &src) {
+            RemoveAll();
+            m_aT = src.m_aT;
+            m_nSize = src.m_nSize;
+            m_nAllocSize = src.m_nAllocSize;
+            src.m_aT = NULL;
+            src.m_nSize = 0;
+            src.m_nAllocSize = 0;
         }
         return *this;
     }
@@ -88,17 +397,28 @@ public:
     }
 
     BOOL Add(const T& t)
+    {
+        return Emplace(t);
+    }
+
+    BOOL Add(T&& t)
+    {
+        return Emplace(std::move(t));
+    }
+
+    // Constructs a new last element in place from args
+    template <typename... Args>
+    BOOL Emplace(Args&&... args)
     {
         if (m_nSize == m_nAllocSize) {
-            int nNewAllocSize = (m_nAllocSize == 0) ? 1 : (m_nSize * 2);
-            T* aT = (T*)realloc(m_aT, nNewAllocSize * sizeof(T));
-            if (aT == NULL)
+            // args may refer into m_aT, so build the element before growing
+            T t(std::forward<Args>(args)...);
+            if (!Grow())
                 return FALSE;
-            m_nAllocSize = nNewAllocSize;
-            m_aT = aT;
+            ::new (&m_aT[m_nSize]) T(std::move(t));
+        } else {
+            ::new (&m_aT[m_nSize]) T(std::forward<Args>(args)...);
         }
-        // Use placement new for proper construction
-        ::new (&m_aT[m_nSize]) T(t);
         m_nSize++;
         return TRUE;
     }
@@ -118,8 +438,7 @@ public:
             return FALSE;
 
         m_aT[nIndex].~T();
-        if (nIndex != (m_nSize - 1))
-            memmove(&m_aT[nIndex], &m_aT[nIndex + 1], (m_nSize - nIndex - 1) * sizeof(T));
+        AtlSimpleCloseGap(m_aT, nIndex, m_nSize);
         m_nSize--;
         return TRUE;
     }
@@ -136,6 +455,40 @@ public:
         m_nAllocSize = 0;
     }
 
+    // Removes the element at nIndex by moving the last element into its
+    // place: O(1), but does not preserve order
+    BOOL RemoveAtUnordered(int nIndex)
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
+            return FALSE;
+
+        m_aT[nIndex].~T();
+        if (nIndex != (m_nSize - 1))
+            AtlSimpleRelocateOne(&m_aT[nIndex], &m_aT[m_nSize - 1]);
+        m_nSize--;
+        return TRUE;
+    }
+
+    // Removes every element for which pred(element) is true, keeping the
+    // order of the rest. Returns the number of elements removed.
+    template <typename TPred>
+    int RemoveIf(TPred pred)
+    {
+        int nOldSize = m_nSize;
+        m_nSize = AtlSimpleRemoveIf(m_aT, m_nSize, pred);
+        return nOldSize - m_nSize;
+    }
+
+    // Removes every element equal to one of pItems[0, nCount) in a single
+    // pass. Returns the number of elements removed.
+    int RemoveAll(const T* pItems, int nCount)
+    {
+        int nOldSize = m_nSize;
+        m_nSize = AtlSimpleRemoveItems<T, TEqual>(m_aT, m_nSize, pItems, nCount);
+        return nOldSize - m_nSize;
+    }
+
     const T& operator[](int nIndex) const
     {
         ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
@@ -155,11 +508,7 @@ public:
 
     int Find(const T& t) const
     {
-        for (int i = 0; i < m_nSize; i++) {
-            if (TEqual::IsEqual(m_aT[i], t))
-                return i;
-        }
-        return -1;
+        return AtlSimpleFind<T, TEqual>(m_aT, m_nSize, t);
     }
 
     BOOL SetAtIndex(int nIndex, const T& t)
@@ -170,53 +519,130 @@ public:
         m_aT[nIndex] = t;
         return TRUE;
     }
+
+private:
+    BOOL Grow()
+    {
+        int nNewAllocSize = (m_nAllocSize == 0) ? 1 : (m_nAllocSize * 2);
+        T* aT = AtlSimpleRelocate(m_aT, m_nSize, nNewAllocSize);
+        if (aT == NULL)
+            return FALSE;
+        m_nAllocSize = nNewAllocSize;
+        m_aT = aT;
+        return TRUE;
+    }
+
+    // Copies src into an empty array with a single allocation of exactly its size
+    void CopyFrom(const CSimpleArray<T, TEqual>& src)
+    {
+        ATLASSERT(m_aT == NULL);
+        if (src.GetSize() == 0)
+            return;
+        m_aT = (T*)malloc(src.GetSize() * sizeof(T));
+        if (m_aT == NULL)
+            return;
+        m_nAllocSize = src.GetSize();
+        for (int i = 0; i < src.GetSize(); i++) {
+            ::new (&m_aT[i]) T(src.m_aT[i]);
+            m_nSize++;
+        }
+    }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
-// CSimpleMap
+// CSimpleInlineArray - CSimpleArray with room for t_nInline elements inline
+//
+// The first t_nInline elements live inside the object, so small arrays
+// never touch the heap. Past that, the elements move to a heap block that
+// grows geometrically like CSimpleArray's. RemoveAll returns to the inline
+// buffer. The API matches CSimpleArray, so the two can be swapped.
 
-template <typename TKey, typename TVal, typename TEqual = CSimpleArrayEqualHelper<TKey>>
-class CSimpleMap {
+template <typename T, int t_nInline = 8, typename TEqual = CSimpleArrayEqualHelper<T>>
+class CSimpleInlineArray {
 public:
-    TKey* m_aKey;
-    TVal* m_aVal;
+    T* m_aT;
     int m_nSize;
+    int m_nAllocSize;
 
-    CSimpleMap() noexcept : m_aKey(NULL), m_aVal(NULL), m_nSize(0)
+    CSimpleInlineArray() noexcept : m_aT(GetInline()), m_nSize(0), m_nAllocSize(t_nInline)
     {
     }
 
-    ~CSimpleMap()
+    CSimpleInlineArray(const CSimpleInlineArray<T, t_nInline, TEqual>& src)
+        : m_aT(GetInline()), m_nSize(0), m_nAllocSize(t_nInline)
+    {
+        CopyFrom(src);
+    }
+
+    CSimpleInlineArray(CSimpleInlineArray<T, t_nInline, TEqual>&& src)
+        : m_aT(GetInline()), m_nSize(0), m_nAllocSize(t_nInline)
+    {
+        MoveFrom(src);
+    }
+
+    ~CSimpleInlineArray()
     {
         RemoveAll();
     }
 
+    CSimpleInlineArray<T, t_nInline, TEqual>& operator=(const CSimpleInlineArray<T, t_nInline, TEqual>& src)
+    {
+        if (this != &src) {
+            RemoveAll();
+            CopyFrom(src);
+        }
+        return *this;
+    }
+
+    CSimpleInlineArray<T, t_nInline, TEqual>& operator=(CSimpleInlineArray<T, t_nInline, TEqual>&& src)
+    {
+        if (this != &src) {
+            RemoveAll();
+            MoveFrom(src);
+        }
+        return *this;
+    }
+
     int GetSize() const noexcept
     {
         return m_nSize;
     }
 
-    BOOL Add(const TKey& key, const TVal& val)
+    // TRUE while the elements are stored inside the object
+    bool IsInline() const noexcept
     {
-        TKey* pKeyNew = (TKey*)realloc(m_aKey, (m_nSize + 1) * sizeof(TKey));
-        if (pKeyNew == NULL)
-            return FALSE;
-        m_aKey = pKeyNew;
+        return m_aT == GetInline();
+    }
 
-        TVal* pValNew = (TVal*)realloc(m_aVal, (m_nSize + 1) * sizeof(TVal));
-        if (pValNew == NULL)
-            return FALSE;
-        m_aVal = pValNew;
+    BOOL Add(const T& t)
+    {
+        return Emplace(t);
+    }
 
-        ::new (&m_aKey[m_nSize]) TKey(key);
-        ::new (&m_aVal[m_nSize]) TVal(val);
+    BOOL Add(T&& t)
+    {
+        return Emplace(std::move(t));
+    }
+
+    template <typename... Args>
+    BOOL Emplace(Args&&... args)
+    {
+        if (m_nSize == m_nAllocSize) {
+            // args may refer into m_aT, so build the element before growing
+            T t(std::forward<Args>(args)...);
+            if (!Grow())
+                return FALSE;
+            ::new (&m_aT[m_nSize]) T(std::move(t));
+        } else {
+            ::new (&m_aT[m_nSize]) T(std::forward<Args>(args)...);
+        }
         m_nSize++;
         return TRUE;
     }
 
-    BOOL Remove(const TKey& key)
+    BOOL Remove(const T& t)
     {
-        int nIndex = FindKey(key);
+        int nIndex = Find(t);
         if (nIndex < 0)
             return FALSE;
         return RemoveAt(nIndex);
@@ -228,98 +654,899 @@ public:
         if (nIndex < 0 || nIndex >= m_nSize)
             return FALSE;
 
-        m_aKey[nIndex].~TKey();
-        m_aVal[nIndex].~TVal();
-
-        if (nIndex != (m_nSize - 1)) {
-            memmove(&m_aKey[nIndex], &m_aKey[nIndex + 1], (m_nSize - nIndex - 1) * sizeof(TKey));
-            memmove(&m_aVal[nIndex], &m_aVal[nIndex + 1], (m_nSize - nIndex - 1) * sizeof(TVal));
-        }
+        m_aT[nIndex].~T();
+        AtlSimpleCloseGap(m_aT, nIndex, m_nSize);
         m_nSize--;
         return TRUE;
     }
 
     void RemoveAll()
     {
-        if (m_aKey != NULL) {
-            for (int i = 0; i < m_nSize; i++) {
-                m_aKey[i].~TKey();
-                m_aVal[i].~TVal();
-            }
-            free(m_aKey);
-            m_aKey = NULL;
-        }
-        if (m_aVal != NULL) {
-            free(m_aVal);
-            m_aVal = NULL;
-        }
+        for (int i = 0; i < m_nSize; i++)
+            m_aT[i].~T();
+        if (!IsInline())
+            free(m_aT);
+        m_aT = GetInline();
         m_nSize = 0;
+        m_nAllocSize = t_nInline;
     }
 
-    BOOL SetAt(const TKey& key, const TVal& val)
+    // Removes the element at nIndex by moving the last element into its
+    // place: O(1), but does not preserve order
+    BOOL RemoveAtUnordered(int nIndex)
     {
-        int nIndex = FindKey(key);
-        if (nIndex < 0)
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
             return FALSE;
-        m_aVal[nIndex] = val;
+
+        m_aT[nIndex].~T();
+        if (nIndex != (m_nSize - 1))
+            AtlSimpleRelocateOne(&m_aT[nIndex], &m_aT[m_nSize - 1]);
+        m_nSize--;
         return TRUE;
     }
 
-    TVal Lookup(const TKey& key) const
+    // Removes every element for which pred(element) is true, keeping the
+    // order of the rest. Returns the number of elements removed.
+    template <typename TPred>
+    int RemoveIf(TPred pred)
     {
-        int nIndex = FindKey(key);
-        if (nIndex >= 0)
-            return GetValueAt(nIndex);
-        return TVal();
+        int nOldSize = m_nSize;
+        m_nSize = AtlSimpleRemoveIf(m_aT, m_nSize, pred);
+        return nOldSize - m_nSize;
     }
 
-    TKey ReverseLookup(const TVal& val) const
+    // Removes every element equal to one of pItems[0, nCount) in a single
+    // pass. Returns the number of elements removed.
+    int RemoveAll(const T* pItems, int nCount)
     {
-        int nIndex = FindVal(val);
-        if (nIndex >= 0)
-            return GetKeyAt(nIndex);
-        return TKey();
+        int nOldSize = m_nSize;
+        m_nSize = AtlSimpleRemoveItems<T, TEqual>(m_aT, m_nSize, pItems, nCount);
+        return nOldSize - m_nSize;
     }
 
-    TKey& GetKeyAt(int nIndex) const
+    const T& operator[](int nIndex) const
     {
         ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
-        return m_aKey[nIndex];
+        return m_aT[nIndex];
     }
 
-    TVal& GetValueAt(int nIndex) const
+    T& operator[](int nIndex)
     {
         ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
-        return m_aVal[nIndex];
+        return m_aT[nIndex];
     }
 
-    int FindKey(const TKey& key) const
+    T* GetData() const noexcept
     {
-        for (int i = 0; i < m_nSize; i++) {
-            if (TEqual::IsEqual(m_aKey[i], key))
-                return i;
-        }
-        return -1;
+        return m_aT;
     }
 
-    int FindVal(const TVal& val) const
+    int Find(const T& t) const
     {
-        for (int i = 0; i < m_nSize; i++) {
-            if (CSimpleArrayEqualHelper<TVal>::IsEqual(m_aVal[i], val))
-                return i;
-        }
-        return -1;
+        return AtlSimpleFind<T, TEqual>(m_aT, m_nSize, t);
     }
 
-    BOOL SetAtIndex(int nIndex, const TKey& key, const TVal& val)
+    BOOL SetAtIndex(int nIndex, const T& t)
     {
         ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
         if (nIndex < 0 || nIndex >= m_nSize)
             return FALSE;
-        m_aKey[nIndex] = key;
-        m_aVal[nIndex] = val;
+        m_aT[nIndex] = t;
         return TRUE;
     }
+
+private:
+    static_assert(t_nInline > 0, "CSimpleInlineArray needs at least one inline element");
+
+    alignas(T) BYTE m_abInline[t_nInline * sizeof(T)];
+
+    T* GetInline() const noexcept
+    {
+        return (T*)m_abInline;
+    }
+
+    BOOL Grow()
+    {
+        int nNewAllocSize = m_nAllocSize * 2;
+        T* aT;
+        if (IsInline()) {
+            // Spill to the heap; the inline buffer cannot be realloc'd
+            aT = (T*)malloc(nNewAllocSize * sizeof(T));
+            if (aT == NULL)
+                return FALSE;
+            for (int i = 0; i < m_nSize; i++)
+                AtlSimpleRelocateOne(&aT[i], &m_aT[i]);
+        } else {
+            aT = AtlSimpleRelocate(m_aT, m_nSize, nNewAllocSize);
+            if (aT == NULL)
+                return FALSE;
+        }
+        m_aT = aT;
+        m_nAllocSize = nNewAllocSize;
+        return TRUE;
+    }
+
+    void CopyFrom(const CSimpleInlineArray<T, t_nInline, TEqual>& src)
+    {
+        ATLASSERT(m_nSize == 0 && IsInline());
+        if (src.GetSize() > t_nInline) {
+            m_aT = (T*)malloc(src.GetSize() * sizeof(T));
+            if (m_aT == NULL) {
+                m_aT = GetInline();
+                return;
+            }
+            m_nAllocSize = src.GetSize();
+        }
+        for (int i = 0; i < src.GetSize(); i++) {
+            ::new (&m_aT[i]) T(src.m_aT[i]);
+            m_nSize++;
+        }
+    }
+
+    void MoveFrom(CSimpleInlineArray<T, t_nInline, TEqual>& src)
+    {
+        ATLASSERT(m_nSize == 0 && IsInline());
+        if (src.IsInline()) {
+            for (int i = 0; i < src.m_nSize; i++)
+                AtlSimpleRelocateOne(&m_aT[i], &src.m_aT[i]);
+        } else {
+            // Take over the heap block
+            m_aT = src.m_aT;
+            m_nAllocSize = src.m_nAllocSize;
+        }
+        m_nSize = src.m_nSize;
+        src.m_aT = src.GetInline();
+        src.m_nSize = 0;
+        src.m_nAllocSize = t_nInline;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleSortedArray - array kept in ascending order
+//
+// For collections that are searched far more often than they change.
+// Find, LowerBound and UpperBound are binary searches. Add inserts in
+// order, after any equal elements. Merge copies a batch into one block,
+// sorts it and merges it with the existing elements into a second block in
+// a single pass. For scalar elements with the default
+// comparison, the search halves the range with a conditional move instead
+// of a branch, so the loop has no mispredictions and a fixed trip count.
+
+template <typename T>
+class CSimpleSortedArrayCompareHelper {
+public:
+    static bool IsLess(const T& a, const T& b)
+    {
+        return a < b;
+    }
+};
+
+template <typename T, typename TCompare = CSimpleSortedArrayCompareHelper<T>>
+class CSimpleSortedArray {
+public:
+    T* m_aT;
+    int m_nSize;
+    int m_nAllocSize;
+
+    CSimpleSortedArray() noexcept : m_aT(NULL), m_nSize(0), m_nAllocSize(0)
+    {
+    }
+
+    CSimpleSortedArray(const CSimpleSortedArray<T, TCompare>& src) : m_aT(NULL), m_nSize(0), m_nAllocSize(0)
+    {
+        CopyFrom(src);
+    }
+
+    ~CSimpleSortedArray()
+    {
+        RemoveAll();
+    }
+
+    CSimpleSortedArray<T, TCompare>& operator=(const CSimpleSortedArray<T, TCompare>& src)
+    {
+        if (this != &src) {
+            RemoveAll();
+            CopyFrom(src);
+        }
+        return *this;
+    }
+
+    int GetSize() const noexcept
+    {
+        return m_nSize;
+    }
+
+    // Elements are read-only; changing one in place could break the order
+    const T& operator[](int nIndex) const
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        return m_aT[nIndex];
+    }
+
+    const T* GetData() const noexcept
+    {
+        return m_aT;
+    }
+
+    BOOL Add(const T& t)
+    {
+        return Insert(T(t));
+    }
+
+    BOOL Add(T&& t)
+    {
+        return Insert(std::move(t));
+    }
+
+    // Adds nCount items in any order: O(m log m + n). Allocates the sorted
+    // batch and the merged array, plus whatever scratch space
+    // std::stable_sort takes.
+    BOOL Merge(const T* pItems, int nCount)
+    {
+        ATLASSERT(nCount >= 0);
+        if (nCount <= 0)
+            return nCount == 0;
+
+        T* pBatch = (T*)malloc(nCount * sizeof(T));
+        if (pBatch == NULL)
+            return FALSE;
+        for (int i = 0; i < nCount; i++)
+            ::new (&pBatch[i]) T(pItems[i]);
+        std::stable_sort(pBatch, pBatch + nCount,
+            [](const T& a, const T& b) { return TCompare::IsLess(a, b); });
+
+        int nNewSize = m_nSize + nCount;
+        T* aNew = (T*)malloc(nNewSize * sizeof(T));
+        if (aNew == NULL) {
+            for (int i = 0; i < nCount; i++)
+                pBatch[i].~T();
+            free(pBatch);
+            return FALSE;
+        }
+
+        // Existing elements go first among equals, as with Add
+        int i = 0;
+        int j = 0;
+        for (int k = 0; k < nNewSize; k++) {
+            if (j == nCount || (i < m_nSize && !TCompare::IsLess(pBatch[j], m_aT[i])))
+                AtlSimpleRelocateOne(&aNew[k], &m_aT[i++]);
+            else
+                AtlSimpleRelocateOne(&aNew[k], &pBatch[j++]);
+        }
+
+        // Every element was relocated out, so only the blocks are freed
+        free(pBatch);
+        free(m_aT);
+        m_aT = aNew;
+        m_nSize = nNewSize;
+        m_nAllocSize = nNewSize;
+        return TRUE;
+    }
+
+    BOOL Remove(const T& t)
+    {
+        int nIndex = Find(t);
+        if (nIndex < 0)
+            return FALSE;
+        return RemoveAt(nIndex);
+    }
+
+    BOOL RemoveAt(int nIndex)
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
+            return FALSE;
+
+        m_aT[nIndex].~T();
+        AtlSimpleCloseGap(m_aT, nIndex, m_nSize);
+        m_nSize--;
+        return TRUE;
+    }
+
+    void RemoveAll()
+    {
+        if (m_aT != NULL) {
+            for (int i = 0; i < m_nSize; i++)
+                m_aT[i].~T();
+            free(m_aT);
+            m_aT = NULL;
+        }
+        m_nSize = 0;
+        m_nAllocSize = 0;
+    }
+
+    // Returns the index of the first element equal to t, or -1
+    int Find(const T& t) const
+    {
+        int nIndex = LowerBound(t);
+        if (nIndex < m_nSize && !TCompare::IsLess(t, m_aT[nIndex]))
+            return nIndex;
+        return -1;
+    }
+
+    // Returns the index of the first element not less than t
+    int LowerBound(const T& t) const
+    {
+        if (m_nSize == 0)
+            return 0;
+
+        if constexpr (std::is_scalar<T>::value && std::is_same<TCompare, CSimpleSortedArrayCompareHelper<T>>::value) {
+            // Branchless: the loop runs log2(n) times whatever the data
+            const T* pBase = m_aT;
+            int n = m_nSize;
+            while (n > 1) {
+                int nHalf = n / 2;
+                pBase = (pBase[nHalf - 1] < t) ? pBase + nHalf : pBase;
+                n -= nHalf;
+            }
+            return (int)(pBase - m_aT) + ((*pBase < t) ? 1 : 0);
+        } else {
+            int nLow = 0;
+            int nHigh = m_nSize;
+            while (nLow < nHigh) {
+                int nMid = nLow + (nHigh - nLow) / 2;
+                if (TCompare::IsLess(m_aT[nMid], t))
+                    nLow = nMid + 1;
+                else
+                    nHigh = nMid;
+            }
+            return nLow;
+        }
+    }
+
+    // Returns the index of the first element greater than t
+    int UpperBound(const T& t) const
+    {
+        int nLow = 0;
+        int nHigh = m_nSize;
+        while (nLow < nHigh) {
+            int nMid = nLow + (nHigh - nLow) / 2;
+            if (TCompare::IsLess(t, m_aT[nMid]))
+                nHigh = nMid;
+            else
+                nLow = nMid + 1;
+        }
+        return nLow;
+    }
+
+private:
+    BOOL Insert(T&& t)
+    {
+        int nIndex = UpperBound(t);
+        if (m_nSize == m_nAllocSize) {
+            int nNewAllocSize = (m_nAllocSize == 0) ? 4 : (m_nAllocSize * 2);
+            T* aT = AtlSimpleRelocate(m_aT, m_nSize, nNewAllocSize);
+            if (aT == NULL)
+                return FALSE;
+            m_aT = aT;
+            m_nAllocSize = nNewAllocSize;
+        }
+        AtlSimpleOpenGap(m_aT, nIndex, m_nSize);
+        ::new (&m_aT[nIndex]) T(std::move(t));
+        m_nSize++;
+        return TRUE;
+    }
+
+    void CopyFrom(const CSimpleSortedArray<T, TCompare>& src)
+    {
+        ATLASSERT(m_aT == NULL);
+        if (src.GetSize() == 0)
+            return;
+        m_aT = (T*)malloc(src.GetSize() * sizeof(T));
+        if (m_aT == NULL)
+            return;
+        m_nAllocSize = src.GetSize();
+        for (int i = 0; i < src.GetSize(); i++) {
+            ::new (&m_aT[i]) T(src.m_aT[i]);
+            m_nSize++;
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleMap
+
+template <typename TKey, typename TVal, typename TEqual = CSimpleArrayEqualHelper<TKey>>
+class CSimpleMap {
+public:
+    TKey* m_aKey;
+    TVal* m_aVal;
+    int m_nSize;
+    int m_nAllocSize;
+
+    CSimpleMap() noexcept : m_aKey(NULL), m_aVal(NULL), m_nSize(0), m_nAllocSize(0)
+    {
+    }
+
+    ~CSimpleMap()
+    {
+        RemoveAll();
+    }
+
+    int GetSize() const noexcept
+    {
+        return m_nSize;
+    }
+
+    BOOL Add(const TKey& key, const TVal& val)
+    {
+        if (m_nSize == m_nAllocSize && !Grow(m_nSize + 1))
+            return FALSE;
+
+        ::new (&m_aKey[m_nSize]) TKey(key);
+        ::new (&m_aVal[m_nSize]) TVal(val);
+        m_nSize++;
+        return TRUE;
+    }
+
+    // Adds nCount pairs, growing the arrays at most once
+    BOOL AddRange(const TKey* pKeys, const TVal* pVals, int nCount)
+    {
+        ATLASSERT(nCount >= 0);
+        if (nCount <= 0)
+            return nCount == 0;
+        if (m_nSize + nCount > m_nAllocSize && !Grow(m_nSize + nCount))
+            return FALSE;
+
+        for (int i = 0; i < nCount; i++) {
+            ::new (&m_aKey[m_nSize]) TKey(pKeys[i]);
+            ::new (&m_aVal[m_nSize]) TVal(pVals[i]);
+            m_nSize++;
+        }
+        return TRUE;
+    }
+
+    int GetAllocSize() const noexcept
+    {
+        return m_nAllocSize;
+    }
+
+    // Makes room for at least nAllocSize pairs without growing again
+    BOOL Reserve(int nAllocSize)
+    {
+        if (nAllocSize <= m_nAllocSize)
+            return TRUE;
+        return Realloc(nAllocSize);
+    }
+
+    // Releases capacity beyond the current size
+    void FreeExtra()
+    {
+        if (m_nSize == m_nAllocSize)
+            return;
+        if (m_nSize == 0) {
+            RemoveAll();
+            return;
+        }
+        Realloc(m_nSize);
+    }
+
+    BOOL Remove(const TKey& key)
+    {
+        int nIndex = FindKey(key);
+        if (nIndex < 0)
+            return FALSE;
+        return RemoveAt(nIndex);
+    }
+
+    BOOL RemoveAt(int nIndex)
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
+            return FALSE;
+
+        m_aKey[nIndex].~TKey();
+        m_aVal[nIndex].~TVal();
+        AtlSimpleCloseGap(m_aKey, nIndex, m_nSize);
+        AtlSimpleCloseGap(m_aVal, nIndex, m_nSize);
+        m_nSize--;
+        return TRUE;
+    }
+
+    void RemoveAll()
+    {
+        if (m_aKey != NULL) {
+            for (int i = 0; i < m_nSize; i++) {
+                m_aKey[i].~TKey();
+                m_aVal[i].~TVal();
+            }
+            free(m_aKey);
+            m_aKey = NULL;
+        }
+        if (m_aVal != NULL) {
+            free(m_aVal);
+            m_aVal = NULL;
+        }
+        m_nSize = 0;
+        m_nAllocSize = 0;
+    }
+
+    BOOL SetAt(const TKey& key, const TVal& val)
+    {
+        int nIndex = FindKey(key);
+        if (nIndex < 0)
+            return FALSE;
+        m_aVal[nIndex] = val;
+        return TRUE;
+    }
+
+    TVal Lookup(const TKey& key) const
+    {
+        int nIndex = FindKey(key);
+        if (nIndex >= 0)
+            return GetValueAt(nIndex);
+        return TVal();
+    }
+
+    TKey ReverseLookup(const TVal& val) const
+    {
+        int nIndex = FindVal(val);
+        if (nIndex >= 0)
+            return GetKeyAt(nIndex);
+        return TKey();
+    }
+
+    TKey& GetKeyAt(int nIndex) const
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        return m_aKey[nIndex];
+    }
+
+    TVal& GetValueAt(int nIndex) const
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        return m_aVal[nIndex];
+    }
+
+    int FindKey(const TKey& key) const
+    {
+        return AtlSimpleFind<TKey, TEqual>(m_aKey, m_nSize, key);
+    }
+
+    int FindVal(const TVal& val) const
+    {
+        return AtlSimpleFind(m_aVal, m_nSize, val);
+    }
+
+    BOOL SetAtIndex(int nIndex, const TKey& key, const TVal& val)
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
+            return FALSE;
+        m_aKey[nIndex] = key;
+        m_aVal[nIndex] = val;
+        return TRUE;
+    }
+
+private:
+    // Grows geometrically so that n Adds cost O(n) element copies in total
+    BOOL Grow(int nMinAllocSize)
+    {
+        int nNewAllocSize = (m_nAllocSize == 0) ? 4 : (m_nAllocSize * 2);
+        if (nNewAllocSize < nMinAllocSize)
+            nNewAllocSize = nMinAllocSize;
+        return Realloc(nNewAllocSize);
+    }
+
+    BOOL Realloc(int nNewAllocSize)
+    {
+        ATLASSERT(nNewAllocSize >= m_nSize);
+        TKey* pKeyNew = AtlSimpleRelocate(m_aKey, m_nSize, nNewAllocSize);
+        if (pKeyNew == NULL)
+            return FALSE;
+        m_aKey = pKeyNew;
+
+        TVal* pValNew = AtlSimpleRelocate(m_aVal, m_nSize, nNewAllocSize);
+        if (pValNew == NULL) {
+            // m_aKey already has the new size; capacity is the smaller of the two
+            if (nNewAllocSize < m_nAllocSize)
+                m_nAllocSize = nNewAllocSize;
+            return FALSE;
+        }
+        m_aVal = pValNew;
+        m_nAllocSize = nNewAllocSize;
+        return TRUE;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleHashHelper - default hash for CSimpleHashMap
+//
+// Integers, enums and pointers are mixed with a 64-bit multiply so that
+// sequential IDs and aligned pointers spread over the low bits. Other
+// types use std::hash.
+
+template <typename T>
+class CSimpleHashHelper {
+public:
+    static UINT Hash(const T& t)
+    {
+        if constexpr (std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value) {
+            unsigned long long n;
+            if constexpr (std::is_pointer<T>::value)
+                n = (unsigned long long)(UINT_PTR)t;
+            else
+                n = (unsigned long long)t;
+            n *= 0x9E3779B97F4A7C15ull;
+            return (UINT)(n >> 32);
+        } else {
+            return (UINT)std::hash<T>()(t);
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleHashMap - CSimpleMap with a hash index
+//
+// Keys and values live in two dense arrays, as in CSimpleMap, so
+// GetKeyAt / GetValueAt and index loops keep working. A separate
+// open-addressing table maps keys to those indices. It uses linear probing,
+// stores each key's hash next to its index, and stays at most half full.
+// Lookups touch one or two cache lines, and Add reallocates only when the
+// arrays double.
+//
+// There are two differences from CSimpleMap. Keys are unique, so Add fails
+// when the key is already present. Remove and RemoveAt move the last entry
+// into the hole instead of shifting the tail, so the order of entries
+// after the removed one changes.
+
+template <typename TKey, typename TVal, typename THash = CSimpleHashHelper<TKey>, typename TEqual = CSimpleArrayEqualHelper<TKey>>
+class CSimpleHashMap {
+public:
+    TKey* m_aKey;
+    TVal* m_aVal;
+    int m_nSize;
+    int m_nAllocSize;
+
+    CSimpleHashMap() noexcept
+        : m_aKey(NULL), m_aVal(NULL), m_nSize(0), m_nAllocSize(0), m_aIndex(NULL), m_nIndexSize(0)
+    {
+    }
+
+    ~CSimpleHashMap()
+    {
+        RemoveAll();
+    }
+
+    int GetSize() const noexcept
+    {
+        return m_nSize;
+    }
+
+    BOOL Add(const TKey& key, const TVal& val)
+    {
+        UINT nHash = THash::Hash(key);
+        if (FindSlot(key, nHash) >= 0)
+            return FALSE;
+
+        if (m_nSize == m_nAllocSize) {
+            int nNewAllocSize = (m_nAllocSize == 0) ? 4 : (m_nAllocSize * 2);
+            TKey* pKeyNew = AtlSimpleRelocate(m_aKey, m_nSize, nNewAllocSize);
+            if (pKeyNew == NULL)
+                return FALSE;
+            m_aKey = pKeyNew;
+
+            TVal* pValNew = AtlSimpleRelocate(m_aVal, m_nSize, nNewAllocSize);
+            if (pValNew == NULL)
+                return FALSE;
+            m_aVal = pValNew;
+            m_nAllocSize = nNewAllocSize;
+        }
+
+        if ((m_nSize + 1) * 2 > m_nIndexSize) {
+            if (!Rehash((m_nIndexSize == 0) ? 16 : (m_nIndexSize * 2)))
+                return FALSE;
+        }
+
+        ::new (&m_aKey[m_nSize]) TKey(key);
+        ::new (&m_aVal[m_nSize]) TVal(val);
+        LinkSlot(nHash, m_nSize);
+        m_nSize++;
+        return TRUE;
+    }
+
+    BOOL Remove(const TKey& key)
+    {
+        int nIndex = FindKey(key);
+        if (nIndex < 0)
+            return FALSE;
+        return RemoveAt(nIndex);
+    }
+
+    BOOL RemoveAt(int nIndex)
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
+            return FALSE;
+
+        UnlinkSlot(FindSlotOfIndex(nIndex));
+        m_aKey[nIndex].~TKey();
+        m_aVal[nIndex].~TVal();
+
+        int nLast = m_nSize - 1;
+        if (nIndex != nLast) {
+            // Relocate the last entry into the hole and repoint its slot
+            m_aIndex[FindSlotOfIndex(nLast)].nIndex = nIndex;
+            AtlSimpleRelocateOne(&m_aKey[nIndex], &m_aKey[nLast]);
+            AtlSimpleRelocateOne(&m_aVal[nIndex], &m_aVal[nLast]);
+        }
+        m_nSize--;
+        return TRUE;
+    }
+
+    void RemoveAll()
+    {
+        if (m_aKey != NULL) {
+            for (int i = 0; i < m_nSize; i++) {
+                m_aKey[i].~TKey();
+                m_aVal[i].~TVal();
+            }
+            free(m_aKey);
+            m_aKey = NULL;
+        }
+        if (m_aVal != NULL) {
+            free(m_aVal);
+            m_aVal = NULL;
+        }
+        if (m_aIndex != NULL) {
+            free(m_aIndex);
+            m_aIndex = NULL;
+        }
+        m_nSize = 0;
+        m_nAllocSize = 0;
+        m_nIndexSize = 0;
+    }
+
+    BOOL SetAt(const TKey& key, const TVal& val)
+    {
+        int nIndex = FindKey(key);
+        if (nIndex < 0)
+            return FALSE;
+        m_aVal[nIndex] = val;
+        return TRUE;
+    }
+
+    TVal Lookup(const TKey& key) const
+    {
+        int nIndex = FindKey(key);
+        if (nIndex >= 0)
+            return GetValueAt(nIndex);
+        return TVal();
+    }
+
+    TKey ReverseLookup(const TVal& val) const
+    {
+        int nIndex = FindVal(val);
+        if (nIndex >= 0)
+            return GetKeyAt(nIndex);
+        return TKey();
+    }
+
+    TKey& GetKeyAt(int nIndex) const
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        return m_aKey[nIndex];
+    }
+
+    TVal& GetValueAt(int nIndex) const
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        return m_aVal[nIndex];
+    }
+
+    int FindKey(const TKey& key) const
+    {
+        int iSlot = FindSlot(key, THash::Hash(key));
+        return (iSlot >= 0) ? m_aIndex[iSlot].nIndex : -1;
+    }
+
+    // Values are not indexed; this is a linear scan as in CSimpleMap
+    int FindVal(const TVal& val) const
+    {
+        return AtlSimpleFind(m_aVal, m_nSize, val);
+    }
+
+    BOOL SetAtIndex(int nIndex, const TKey& key, const TVal& val)
+    {
+        ATLASSERT(nIndex >= 0 && nIndex < m_nSize);
+        if (nIndex < 0 || nIndex >= m_nSize)
+            return FALSE;
+
+        UINT nHash = THash::Hash(key);
+        int iSlot = FindSlot(key, nHash);
+        if (iSlot >= 0 && m_aIndex[iSlot].nIndex != nIndex)
+            return FALSE;
+        if (iSlot < 0) {
+            UnlinkSlot(FindSlotOfIndex(nIndex));
+            LinkSlot(nHash, nIndex);
+        }
+        m_aKey[nIndex] = key;
+        m_aVal[nIndex] = val;
+        return TRUE;
+    }
+
+private:
+    struct _Slot {
+        UINT nHash;
+        int nIndex;     // -1 while the slot is empty
+    };
+
+    _Slot* m_aIndex;
+    int m_nIndexSize;   // power of two, or 0 before the first Add
+
+    int FindSlot(const TKey& key, UINT nHash) const
+    {
+        if (m_nIndexSize == 0)
+            return -1;
+        int nMask = m_nIndexSize - 1;
+        for (int iSlot = (int)(nHash & nMask); ; iSlot = (iSlot + 1) & nMask) {
+            const _Slot& slot = m_aIndex[iSlot];
+            if (slot.nIndex < 0)
+                return -1;
+            if (slot.nHash == nHash && TEqual::IsEqual(m_aKey[slot.nIndex], key))
+                return iSlot;
+        }
+    }
+
+    int FindSlotOfIndex(int nIndex) const
+    {
+        int nMask = m_nIndexSize - 1;
+        int iSlot = (int)(THash::Hash(m_aKey[nIndex]) & nMask);
+        while (m_aIndex[iSlot].nIndex != nIndex)
+            iSlot = (iSlot + 1) & nMask;
+        return iSlot;
+    }
+
+    void LinkSlot(UINT nHash, int nIndex) noexcept
+    {
+        int nMask = m_nIndexSize - 1;
+        int iSlot = (int)(nHash & nMask);
+        while (m_aIndex[iSlot].nIndex >= 0)
+            iSlot = (iSlot + 1) & nMask;
+        m_aIndex[iSlot].nHash = nHash;
+        m_aIndex[iSlot].nIndex = nIndex;
+    }
+
+    // Backward-shift deletion keeps probe runs unbroken without tombstones
+    void UnlinkSlot(int iSlot) noexcept
+    {
+        int nMask = m_nIndexSize - 1;
+        int iHole = iSlot;
+        for (int iNext = (iHole + 1) & nMask; m_aIndex[iNext].nIndex >= 0; iNext = (iNext + 1) & nMask) {
+            // An entry may fill the hole only if its home slot is not
+            // cyclically within (iHole, iNext]
+            int iHome = (int)(m_aIndex[iNext].nHash & nMask);
+            if (((iNext - iHome) & nMask) >= ((iNext - iHole) & nMask)) {
+                m_aIndex[iHole] = m_aIndex[iNext];
+                iHole = iNext;
+            }
+        }
+        m_aIndex[iHole].nIndex = -1;
+    }
+
+    bool Rehash(int nNewIndexSize)
+    {
+        _Slot* aNewIndex = (_Slot*)malloc(nNewIndexSize * sizeof(_Slot));
+        if (aNewIndex == NULL)
+            return false;
+        for (int i = 0; i < nNewIndexSize; i++)
+            aNewIndex[i].nIndex = -1;
+
+        _Slot* aOldIndex = m_aIndex;
+        int nOldIndexSize = m_nIndexSize;
+        m_aIndex = aNewIndex;
+        m_nIndexSize = nNewIndexSize;
+        for (int i = 0; i < nOldIndexSize; i++) {
+            if (aOldIndex[i].nIndex >= 0)
+                LinkSlot(aOldIndex[i].nHash, aOldIndex[i].nIndex);
+        }
+        free(aOldIndex);
+        return true;
+    }
+
+    CSimpleHashMap(const CSimpleHashMap&) = delete;
+    CSimpleHashMap& operator=(const CSimpleHashMap&) = delete;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,948 @@
+// OpenATL - Clean-room ATL subset for WTL 10.0
+// Reference-counted string base (CSimpleStringT)
+
+#ifndef __ATLSIMPSTR_H__
+#define __ATLSIMPSTR_H__
+
+#pragma once
+
+#include "atldef.h"
+#include "atlsimpcoll.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace ATL {
+
+///////////////////////////////////////////////////////////////////////////////
+// CStringData - header in front of every string buffer
+//
+// A string object holds just a pointer to its characters. The header
+// directly in front of them carries the length, capacity and reference
+// count. Copying a string shares the buffer and costs one interlocked
+// increment. Any write to a shared buffer first copies it (copy on
+// write). LockBuffer marks a buffer as locked (nRefs < 0), and copies of a
+// locked string get their own buffer.
+//
+// Every block records the IAtlStringMgr that allocated it, and is returned
+// to that manager when the last reference goes away. Empty strings share
+// the manager's nil block, which has zero capacity. Reference counting
+// skips it, so empty strings never touch a shared cache line.
+
+class IAtlStringMgr;
+
+struct CStringData {
+    IAtlStringMgr* pStringMgr;
+    int nDataLength;    // characters, not counting the terminator
+    int nAllocLength;   // capacity in characters, not counting the terminator
+    LONG nRefs;         // > 1 shared, 1 exclusive, < 0 locked
+
+    void* data() noexcept
+    {
+        return this + 1;
+    }
+
+    bool IsNil() const noexcept
+    {
+        return nAllocLength == 0;
+    }
+
+    void AddRef() noexcept
+    {
+        ATLASSERT(nRefs > 0);
+        if (!IsNil())
+            ::InterlockedIncrement(&nRefs);
+    }
+
+    void Release() noexcept;
+
+    bool IsShared() const noexcept
+    {
+        return nRefs > 1;
+    }
+
+    bool IsLocked() const noexcept
+    {
+        return nRefs < 0;
+    }
+
+    void Lock() noexcept
+    {
+        ATLASSERT(nRefs <= 1);
+        nRefs--;        // 1 -> 0 -> -1; an already locked buffer goes further negative
+        if (nRefs == 0)
+            nRefs = -1;
+    }
+
+    void Unlock() noexcept
+    {
+        ATLASSERT(IsLocked());
+        if (IsLocked()) {
+            nRefs++;
+            if (nRefs == 0)
+                nRefs = 1;
+        }
+    }
+};
+
+// The nil block: a header with zero capacity followed by a terminator that
+// is wide enough for any character type
+struct CNilStringData {
+    CStringData header;
+    wchar_t achNil[2];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// IAtlStringMgr - allocator for string buffers
+//
+// Allocate returns a block with room for nAllocLength characters plus the
+// terminator, with pStringMgr, nDataLength (0), nAllocLength and nRefs (1)
+// filled in. A manager may round nAllocLength up. Reallocate keeps the
+// contents. Both return NULL on failure. Clone returns the manager that
+// copies of a string should allocate from.
+
+class ATL_NO_VTABLE IAtlStringMgr {
+public:
+    virtual CStringData* Allocate(int nAllocLength, int nCharSize) noexcept = 0;
+    virtual void Free(CStringData* pData) noexcept = 0;
+    virtual CStringData* Reallocate(CStringData* pData, int nAllocLength, int nCharSize) noexcept = 0;
+    virtual CStringData* GetNilString() noexcept = 0;
+    virtual IAtlStringMgr* Clone() noexcept = 0;
+};
+
+inline void CStringData::Release() noexcept
+{
+    ATLASSERT(nRefs != 0);
+    if (!IsNil() && ::InterlockedDecrement(&nRefs) <= 0)
+        pStringMgr->Free(this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CAtlStringMgr - string manager on the CRT heap
+//
+// The constructor is constexpr, so the default manager and its nil block
+// are constant-initialized and strings in static constructors can use them.
+
+class CAtlStringMgr : public IAtlStringMgr {
+public:
+    constexpr CAtlStringMgr() noexcept : m_nil{ { this, 0, 0, 2 }, { 0, 0 } }
+    {
+    }
+
+    virtual CStringData* Allocate(int nAllocLength, int nCharSize) noexcept
+    {
+        if (nAllocLength < 0 || (size_t)nAllocLength >= (SIZE_MAX - sizeof(CStringData)) / nCharSize)
+            return NULL;
+        CStringData* pData = (CStringData*)malloc(sizeof(CStringData) + (size_t)(nAllocLength + 1) * nCharSize);
+        if (pData == NULL)
+            return NULL;
+        pData->pStringMgr = this;
+        pData->nDataLength = 0;
+        pData->nAllocLength = nAllocLength;
+        pData->nRefs = 1;
+        return pData;
+    }
+
+    virtual void Free(CStringData* pData) noexcept
+    {
+        free(pData);
+    }
+
+    virtual CStringData* Reallocate(CStringData* pData, int nAllocLength, int nCharSize) noexcept
+    {
+        if (nAllocLength < 0 || (size_t)nAllocLength >= (SIZE_MAX - sizeof(CStringData)) / nCharSize)
+            return NULL;
+        CStringData* pNewData = (CStringData*)realloc(pData, sizeof(CStringData) + (size_t)(nAllocLength + 1) * nCharSize);
+        if (pNewData == NULL)
+            return NULL;
+        pNewData->nAllocLength = nAllocLength;
+        return pNewData;
+    }
+
+    virtual CStringData* GetNilString() noexcept
+    {
+        return &m_nil.header;
+    }
+
+    virtual IAtlStringMgr* Clone() noexcept
+    {
+        return this;
+    }
+
+protected:
+    CNilStringData m_nil;
+};
+
+__declspec(selectany) CAtlStringMgr _AtlDefaultStringMgr;
+
+inline IAtlStringMgr* AtlGetDefaultStringMgr() noexcept
+{
+    return &_AtlDefaultStringMgr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CAtlThreadCacheStringMgr - string manager with per-thread block caches
+//
+// Blocks come in fixed size classes of 64 to 2048 bytes. A freed block goes
+// onto a free list owned by the freeing thread, and the next allocation of
+// that class on the thread pops it again, so short-lived strings recycle
+// the same few blocks without touching the heap or any lock. A block freed
+// on another thread simply joins that thread's cache. Each list keeps at
+// most 64 blocks; the rest, blocks over 2048 bytes, and the cache
+// of an exiting thread go back to the CRT heap.
+//
+// Use it for strings that are created and destroyed at a high rate:
+//
+//     static CAtlThreadCacheStringMgr s_strMgr;
+//     CString strText(&s_strMgr);
+
+class CAtlThreadCacheStringMgr : public IAtlStringMgr {
+public:
+    constexpr CAtlThreadCacheStringMgr() noexcept : m_nil{ { this, 0, 0, 2 }, { 0, 0 } }
+    {
+    }
+
+    virtual CStringData* Allocate(int nAllocLength, int nCharSize) noexcept
+    {
+        if (nAllocLength < 0 || (size_t)nAllocLength >= (SIZE_MAX - sizeof(_Block) - sizeof(CStringData)) / nCharSize)
+            return NULL;
+        size_t nBytes = sizeof(_Block) + sizeof(CStringData) + (size_t)(nAllocLength + 1) * nCharSize;
+        int nClass = SizeClass(nBytes);
+
+        _Block* pBlock = NULL;
+        if (nClass < _nClasses) {
+            _ThreadCache& cache = GetThreadCache();
+            pBlock = cache.apFree[nClass];
+            if (pBlock != NULL) {
+                cache.apFree[nClass] = pBlock->pNext;
+                cache.anFree[nClass]--;
+            } else {
+                pBlock = (_Block*)malloc(ClassBytes(nClass));
+            }
+            nBytes = ClassBytes(nClass);
+        } else {
+            pBlock = (_Block*)malloc(nBytes);
+        }
+        if (pBlock == NULL)
+            return NULL;
+
+        pBlock->nClass = nClass;
+        CStringData* pData = (CStringData*)(pBlock + 1);
+        pData->pStringMgr = this;
+        pData->nDataLength = 0;
+        pData->nAllocLength = Capacity(nBytes, nCharSize);
+        pData->nRefs = 1;
+        return pData;
+    }
+
+    virtual void Free(CStringData* pData) noexcept
+    {
+        _Block* pBlock = ((_Block*)pData) - 1;
+        int nClass = pBlock->nClass;
+        if (nClass < _nClasses) {
+            _ThreadCache& cache = GetThreadCache();
+            if (cache.anFree[nClass] < _nMaxCached) {
+                pBlock->pNext = cache.apFree[nClass];
+                cache.apFree[nClass] = pBlock;
+                cache.anFree[nClass]++;
+                return;
+            }
+        }
+        free(pBlock);
+    }
+
+    virtual CStringData* Reallocate(CStringData* pData, int nAllocLength, int nCharSize) noexcept
+    {
+        _Block* pBlock = ((_Block*)pData) - 1;
+        if (pBlock->nClass >= _nClasses) {
+            // Already a heap block: resize it in place
+            if (nAllocLength < 0 || (size_t)nAllocLength >= (SIZE_MAX - sizeof(_Block) - sizeof(CStringData)) / nCharSize)
+                return NULL;
+            size_t nBytes = sizeof(_Block) + sizeof(CStringData) + (size_t)(nAllocLength + 1) * nCharSize;
+            if (SizeClass(nBytes) >= _nClasses) {
+                _Block* pNewBlock = (_Block*)realloc(pBlock, nBytes);
+                if (pNewBlock == NULL)
+                    return NULL;
+                CStringData* pNewData = (CStringData*)(pNewBlock + 1);
+                pNewData->nAllocLength = Capacity(nBytes, nCharSize);
+                return pNewData;
+            }
+        }
+
+        CStringData* pNewData = Allocate(nAllocLength, nCharSize);
+        if (pNewData == NULL)
+            return NULL;
+        int nCopy = (pData->nDataLength < pNewData->nAllocLength ? pData->nDataLength : pNewData->nAllocLength);
+        memcpy(pNewData->data(), pData->data(), (size_t)(nCopy + 1) * nCharSize);
+        pNewData->nDataLength = nCopy;
+        pNewData->nRefs = pData->nRefs;
+        Free(pData);
+        return pNewData;
+    }
+
+    virtual CStringData* GetNilString() noexcept
+    {
+        return &m_nil.header;
+    }
+
+    virtual IAtlStringMgr* Clone() noexcept
+    {
+        return this;
+    }
+
+protected:
+    CNilStringData m_nil;
+
+private:
+    enum { _nClasses = 6, _nMinClassBytes = 64, _nMaxCached = 64 };
+
+    // Sits in front of the CStringData header. A block on a free list
+    // stores the link; a block in use stores its size class.
+    union _Block {
+        _Block* pNext;
+        int nClass;
+        double dAlign;
+    };
+
+    struct _ThreadCache {
+        _Block* apFree[_nClasses];
+        int anFree[_nClasses];
+
+        ~_ThreadCache() noexcept
+        {
+            for (int i = 0; i < _nClasses; i++) {
+                while (apFree[i] != NULL) {
+                    _Block* pBlock = apFree[i];
+                    apFree[i] = pBlock->pNext;
+                    free(pBlock);
+                }
+                // Strings freed later in thread or process teardown bypass the cache
+                anFree[i] = _nMaxCached;
+            }
+        }
+    };
+
+    // One cache per thread, shared by every instance; blocks are
+    // interchangeable between managers because each remembers its class
+    static _ThreadCache& GetThreadCache() noexcept
+    {
+        static thread_local _ThreadCache s_cache = {};
+        return s_cache;
+    }
+
+    static size_t ClassBytes(int nClass) noexcept
+    {
+        return (size_t)_nMinClassBytes << nClass;
+    }
+
+    static int SizeClass(size_t nBytes) noexcept
+    {
+        int nClass = 0;
+        while (nClass < _nClasses && ClassBytes(nClass) < nBytes)
+            nClass++;
+        return nClass;
+    }
+
+    static int Capacity(size_t nBytes, int nCharSize) noexcept
+    {
+        size_t nChars = (nBytes - sizeof(_Block) - sizeof(CStringData)) / nCharSize - 1;
+        return (nChars > INT_MAX) ? INT_MAX : (int)nChars;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ChTraitsBase - character type pairs
+
+template <typename BaseType>
+class ChTraitsBase {
+public:
+    typedef char XCHAR;
+    typedef LPSTR PXSTR;
+    typedef LPCSTR PCXSTR;
+    typedef wchar_t YCHAR;
+    typedef LPWSTR PYSTR;
+    typedef LPCWSTR PCYSTR;
+};
+
+template <>
+class ChTraitsBase<wchar_t> {
+public:
+    typedef wchar_t XCHAR;
+    typedef LPWSTR PXSTR;
+    typedef LPCWSTR PCXSTR;
+    typedef char YCHAR;
+    typedef LPSTR PYSTR;
+    typedef LPCSTR PCYSTR;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CSimpleStringT - reference-counted, copy-on-write string
+
+template <typename BaseType>
+class CSimpleStringT {
+public:
+    typedef typename ChTraitsBase<BaseType>::XCHAR XCHAR;
+    typedef typename ChTraitsBase<BaseType>::PXSTR PXSTR;
+    typedef typename ChTraitsBase<BaseType>::PCXSTR PCXSTR;
+    typedef typename ChTraitsBase<BaseType>::YCHAR YCHAR;
+    typedef typename ChTraitsBase<BaseType>::PYSTR PYSTR;
+    typedef typename ChTraitsBase<BaseType>::PCYSTR PCYSTR;
+
+    CSimpleStringT() noexcept
+    {
+        Attach(_AtlDefaultStringMgr.GetNilString());
+    }
+
+    explicit CSimpleStringT(IAtlStringMgr* pStringMgr) noexcept
+    {
+        ATLASSERT(pStringMgr != NULL);
+        Attach(pStringMgr->GetNilString());
+    }
+
+    CSimpleStringT(const CSimpleStringT& strSrc) noexcept
+    {
+        Attach(CloneData(strSrc.GetData()));
+    }
+
+    CSimpleStringT(CSimpleStringT&& strSrc) noexcept
+    {
+        CStringData* pSrcData = strSrc.GetData();
+        Attach(pSrcData);
+        strSrc.Attach(pSrcData->pStringMgr->GetNilString());
+    }
+
+    CSimpleStringT(PCXSTR pszSrc, IAtlStringMgr* pStringMgr = &_AtlDefaultStringMgr)
+    {
+        ATLASSERT(pStringMgr != NULL);
+        Attach(pStringMgr->GetNilString());
+        SetString(pszSrc);
+    }
+
+    CSimpleStringT(const XCHAR* pchSrc, int nLength, IAtlStringMgr* pStringMgr = &_AtlDefaultStringMgr)
+    {
+        ATLASSERT(pStringMgr != NULL);
+        Attach(pStringMgr->GetNilString());
+        SetString(pchSrc, nLength);
+    }
+
+    ~CSimpleStringT() noexcept
+    {
+        GetData()->Release();
+    }
+
+    CSimpleStringT& operator=(const CSimpleStringT& strSrc)
+    {
+        CStringData* pSrcData = strSrc.GetData();
+        CStringData* pOldData = GetData();
+        if (pSrcData != pOldData) {
+            Attach(CloneData(pSrcData));
+            pOldData->Release();
+        }
+        return *this;
+    }
+
+    CSimpleStringT& operator=(CSimpleStringT&& strSrc) noexcept
+    {
+        if (this != &strSrc) {
+            CStringData* pSrcData = strSrc.GetData();
+            GetData()->Release();
+            Attach(pSrcData);
+            strSrc.Attach(pSrcData->pStringMgr->GetNilString());
+        }
+        return *this;
+    }
+
+    CSimpleStringT& operator=(PCXSTR pszSrc)
+    {
+        SetString(pszSrc);
+        return *this;
+    }
+
+    CSimpleStringT& operator+=(const CSimpleStringT& strSrc)
+    {
+        Append(strSrc);
+        return *this;
+    }
+
+    CSimpleStringT& operator+=(PCXSTR pszSrc)
+    {
+        Append(pszSrc);
+        return *this;
+    }
+
+    CSimpleStringT& operator+=(XCHAR ch)
+    {
+        AppendChar(ch);
+        return *this;
+    }
+
+    operator PCXSTR() const noexcept
+    {
+        return m_pszData;
+    }
+
+    PCXSTR GetString() const noexcept
+    {
+        return m_pszData;
+    }
+
+    XCHAR operator[](int iChar) const
+    {
+        ATLASSERT(iChar >= 0 && iChar <= GetLength());
+        return m_pszData[iChar];
+    }
+
+    XCHAR GetAt(int iChar) const
+    {
+        ATLASSERT(iChar >= 0 && iChar <= GetLength());
+        return m_pszData[iChar];
+    }
+
+    void SetAt(int iChar, XCHAR ch)
+    {
+        ATLASSERT(iChar >= 0 && iChar < GetLength());
+        int nLength = GetLength();
+        PXSTR pszBuffer = GetBuffer();
+        pszBuffer[iChar] = ch;
+        ReleaseBufferSetLength(nLength);
+    }
+
+    int GetLength() const noexcept
+    {
+        return GetData()->nDataLength;
+    }
+
+    int GetAllocLength() const noexcept
+    {
+        return GetData()->nAllocLength;
+    }
+
+    bool IsEmpty() const noexcept
+    {
+        return GetLength() == 0;
+    }
+
+    IAtlStringMgr* GetManager() const noexcept
+    {
+        return GetData()->pStringMgr->Clone();
+    }
+
+    void Empty() noexcept
+    {
+        CStringData* pOldData = GetData();
+        if (pOldData->nDataLength == 0)
+            return;
+
+        if (pOldData->IsLocked()) {
+            // Keep the locked buffer; the caller still holds a pointer into it
+            SetLength(0);
+        } else {
+            IAtlStringMgr* pStringMgr = pOldData->pStringMgr;
+            pOldData->Release();
+            Attach(pStringMgr->GetNilString());
+        }
+    }
+
+    void Append(PCXSTR pszSrc)
+    {
+        Append(pszSrc, StringLength(pszSrc));
+    }
+
+    void Append(PCXSTR pszSrc, int nLength)
+    {
+        ATLASSERT(nLength >= 0);
+        if (nLength <= 0)
+            return;
+
+        // pszSrc may point into this string's own buffer
+        UINT_PTR nOffset = (UINT_PTR)(pszSrc - GetString());
+        int nOldLength = GetLength();
+        int nNewLength = nOldLength + nLength;
+        PXSTR pszBuffer = GetBuffer(nNewLength);
+        if (nOffset <= (UINT_PTR)nOldLength)
+            pszSrc = pszBuffer + nOffset;
+        CopyCharsOverlapped(pszBuffer + nOldLength, pszSrc, nLength);
+        ReleaseBufferSetLength(nNewLength);
+    }
+
+    void Append(const CSimpleStringT& strSrc)
+    {
+        Append(strSrc.GetString(), strSrc.GetLength());
+    }
+
+    void AppendChar(XCHAR ch)
+    {
+        int nOldLength = GetLength();
+        PXSTR pszBuffer = GetBuffer(nOldLength + 1);
+        pszBuffer[nOldLength] = ch;
+        ReleaseBufferSetLength(nOldLength + 1);
+    }
+
+    void SetString(PCXSTR pszSrc)
+    {
+        SetString(pszSrc, StringLength(pszSrc));
+    }
+
+    void SetString(PCXSTR pszSrc, int nLength)
+    {
+        ATLASSERT(nLength >= 0);
+        if (nLength <= 0 || pszSrc == NULL) {
+            Empty();
+            return;
+        }
+
+        // pszSrc may point into this string's own buffer
+        UINT_PTR nOffset = (UINT_PTR)(pszSrc - GetString());
+        int nOldLength = GetLength();
+        PXSTR pszBuffer = GetBuffer(nLength);
+        if (nOffset <= (UINT_PTR)nOldLength)
+            CopyCharsOverlapped(pszBuffer, pszBuffer + nOffset, nLength);
+        else
+            CopyChars(pszBuffer, pszSrc, nLength);
+        ReleaseBufferSetLength(nLength);
+    }
+
+    // Returns an unshared, writable buffer holding the current contents
+    PXSTR GetBuffer()
+    {
+        return PrepareWrite(GetLength());
+    }
+
+    // As GetBuffer(), with room for at least nMinBufferLength characters
+    PXSTR GetBuffer(int nMinBufferLength)
+    {
+        return PrepareWrite(nMinBufferLength);
+    }
+
+    PXSTR GetBufferSetLength(int nLength)
+    {
+        PXSTR pszBuffer = GetBuffer(nLength);
+        SetLength(nLength);
+        return pszBuffer;
+    }
+
+    // Ends a GetBuffer; -1 takes the length from the terminator
+    void ReleaseBuffer(int nNewLength = -1)
+    {
+        if (nNewLength == -1) {
+            int nAlloc = GetData()->nAllocLength;
+            nNewLength = StringLengthN(m_pszData, nAlloc);
+        }
+        SetLength(nNewLength);
+    }
+
+    void ReleaseBufferSetLength(int nNewLength)
+    {
+        ATLASSERT(nNewLength >= 0);
+        SetLength(nNewLength);
+    }
+
+    void Truncate(int nNewLength)
+    {
+        ATLASSERT(nNewLength <= GetLength());
+        GetBuffer(nNewLength);
+        ReleaseBufferSetLength(nNewLength);
+    }
+
+    // Makes room for nLength characters without changing the contents
+    void Preallocate(int nLength)
+    {
+        int nOldLength = GetLength();
+        PrepareWrite(nLength > nOldLength ? nLength : nOldLength);
+        SetLength(nOldLength);
+    }
+
+    // Drops unused capacity
+    void FreeExtra()
+    {
+        CStringData* pOldData = GetData();
+        int nLength = pOldData->nDataLength;
+        if (pOldData->IsNil() || pOldData->nAllocLength <= RoundAllocLength(nLength))
+            return;
+        if (nLength == 0) {
+            Empty();
+            return;
+        }
+        if (!pOldData->IsLocked()) {
+            CStringData* pNewData = AllocateData(pOldData->pStringMgr->Clone(), nLength);
+            CopyChars((PXSTR)pNewData->data(), (PCXSTR)pOldData->data(), nLength + 1);
+            pNewData->nDataLength = nLength;
+            pOldData->Release();
+            Attach(pNewData);
+        }
+    }
+
+    PXSTR LockBuffer()
+    {
+        CStringData* pData = GetData();
+        if (pData->IsShared()) {
+            Fork(pData->nDataLength);
+            pData = GetData();
+        }
+        pData->Lock();
+        return m_pszData;
+    }
+
+    void UnlockBuffer() noexcept
+    {
+        CStringData* pData = GetData();
+        if (pData->IsLocked())
+            pData->Unlock();
+    }
+
+    static int StringLength(PCXSTR psz) noexcept
+    {
+        if (psz == NULL)
+            return 0;
+        if constexpr (sizeof(XCHAR) == sizeof(wchar_t))
+            return (int)wcslen((const wchar_t*)psz);
+        else
+            return (int)strlen((const char*)psz);
+    }
+
+    // Length of psz, reading no more than nMaxLength characters
+    static int StringLengthN(PCXSTR psz, int nMaxLength) noexcept
+    {
+        int nLength = 0;
+        while (nLength < nMaxLength && psz[nLength] != 0)
+            nLength++;
+        return nLength;
+    }
+
+    static void CopyChars(XCHAR* pchDest, const XCHAR* pchSrc, int nChars) noexcept
+    {
+        if (nChars > 0)
+            memcpy(pchDest, pchSrc, nChars * sizeof(XCHAR));
+    }
+
+    static void CopyCharsOverlapped(XCHAR* pchDest, const XCHAR* pchSrc, int nChars) noexcept
+    {
+        if (nChars > 0)
+            memmove(pchDest, pchSrc, nChars * sizeof(XCHAR));
+    }
+
+    static void Concatenate(CSimpleStringT& strResult, PCXSTR psz1, int nLength1, PCXSTR psz2, int nLength2)
+    {
+        int nNewLength = nLength1 + nLength2;
+        PXSTR pszBuffer = strResult.GetBuffer(nNewLength);
+        CopyChars(pszBuffer, psz1, nLength1);
+        CopyChars(pszBuffer + nLength1, psz2, nLength2);
+        strResult.ReleaseBufferSetLength(nNewLength);
+    }
+
+protected:
+    // Unshares the buffer and makes room for nLength characters
+    PXSTR PrepareWrite(int nLength)
+    {
+        ATLASSERT(nLength >= 0);
+        if (nLength < 0)
+            AtlThrow(E_INVALIDARG);
+
+        CStringData* pOldData = GetData();
+        if (pOldData->IsShared()) {
+            // The nil block counts as shared, so writes always get a real buffer
+            int nNewLength = (pOldData->nDataLength > nLength) ? pOldData->nDataLength : nLength;
+            Fork(nNewLength);
+        } else if (nLength > pOldData->nAllocLength) {
+            Reallocate(GrowAllocLength(pOldData->nAllocLength, nLength));
+        }
+        return m_pszData;
+    }
+
+    // Sets the length of an exclusively owned buffer
+    void SetLength(int nLength)
+    {
+        CStringData* pData = GetData();
+        ATLASSERT(nLength >= 0 && nLength <= pData->nAllocLength);
+        if (nLength < 0 || nLength > pData->nAllocLength)
+            AtlThrow(E_INVALIDARG);
+
+        if (pData->IsNil())
+            return;
+        pData->nDataLength = nLength;
+        m_pszData[nLength] = 0;
+    }
+
+    CStringData* GetData() const noexcept
+    {
+        return ((CStringData*)m_pszData) - 1;
+    }
+
+private:
+    PXSTR m_pszData;
+
+    void Attach(CStringData* pData) noexcept
+    {
+        m_pszData = (PXSTR)pData->data();
+    }
+
+    // Shares pData unless it is locked, in which case a copy is made
+    static CStringData* CloneData(CStringData* pData)
+    {
+        if (!pData->IsLocked()) {
+            pData->AddRef();
+            return pData;
+        }
+        CStringData* pNewData = AllocateData(pData->pStringMgr->Clone(), pData->nDataLength);
+        CopyChars((PXSTR)pNewData->data(), (PCXSTR)pData->data(), pData->nDataLength + 1);
+        pNewData->nDataLength = pData->nDataLength;
+        return pNewData;
+    }
+
+    // Capacity for nLength characters, rounded so that the buffer including
+    // its terminator is a multiple of 8 characters
+    static int RoundAllocLength(int nLength) noexcept
+    {
+        return ((nLength + 8) & ~7) - 1;
+    }
+
+    static int GrowAllocLength(int nOldAllocLength, int nLength) noexcept
+    {
+        // Grow by half again, so repeated appends are amortized O(1)
+        if (nOldAllocLength < INT_MAX / 2) {
+            int nGrown = nOldAllocLength + nOldAllocLength / 2;
+            if (nGrown > nLength)
+                return nGrown;
+        }
+        return nLength;
+    }
+
+    static CStringData* AllocateData(IAtlStringMgr* pStringMgr, int nLength)
+    {
+        CStringData* pData = pStringMgr->Allocate(RoundAllocLength(nLength), sizeof(XCHAR));
+        if (pData == NULL)
+            AtlThrow(E_OUTOFMEMORY);
+        ((PXSTR)pData->data())[0] = 0;
+        return pData;
+    }
+
+    // Replaces a shared buffer with a private copy that has room for nLength characters
+    void Fork(int nLength)
+    {
+        CStringData* pOldData = GetData();
+        int nOldLength = pOldData->nDataLength;
+        CStringData* pNewData = AllocateData(pOldData->pStringMgr->Clone(), nLength);
+        int nCopy = (nOldLength < nLength ? nOldLength : nLength);
+        CopyChars((PXSTR)pNewData->data(), (PCXSTR)pOldData->data(), nCopy + 1);
+        ((PXSTR)pNewData->data())[nCopy] = 0;
+        pNewData->nDataLength = nCopy;
+        pOldData->Release();
+        Attach(pNewData);
+    }
+
+    // Resizes an exclusively owned buffer in place
+    void Reallocate(int nLength)
+    {
+        CStringData* pOldData = GetData();
+        ATLASSERT(!pOldData->IsShared() && !pOldData->IsNil());
+        CStringData* pNewData = pOldData->pStringMgr->Reallocate(pOldData, RoundAllocLength(nLength), sizeof(XCHAR));
+        if (pNewData == NULL)
+            AtlThrow(E_OUTOFMEMORY);
+        Attach(pNewData);
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CStringViewT - non-owning view of a run of characters
+//
+// A view is a pointer and a length. It is not NUL-terminated and does not
+// keep the string it points into alive; a write to that string may move
+// its buffer. Mid, Left and Right on a view return views.
+
+template <typename BaseType>
+class CStringViewT {
+public:
+    typedef typename ChTraitsBase<BaseType>::XCHAR XCHAR;
+    typedef typename ChTraitsBase<BaseType>::PCXSTR PCXSTR;
+
+    constexpr CStringViewT() noexcept : m_pch(NULL), m_nLength(0)
+    {
+    }
+
+    CStringViewT(PCXSTR psz) noexcept : m_pch(psz), m_nLength(CSimpleStringT<BaseType>::StringLength(psz))
+    {
+    }
+
+    constexpr CStringViewT(const XCHAR* pch, int nLength) noexcept : m_pch(pch), m_nLength(nLength)
+    {
+    }
+
+    CStringViewT(const CSimpleStringT<BaseType>& str) noexcept : m_pch(str.GetString()), m_nLength(str.GetLength())
+    {
+    }
+
+    const XCHAR* GetData() const noexcept
+    {
+        return m_pch;
+    }
+
+    int GetLength() const noexcept
+    {
+        return m_nLength;
+    }
+
+    bool IsEmpty() const noexcept
+    {
+        return m_nLength == 0;
+    }
+
+    XCHAR operator[](int iChar) const
+    {
+        ATLASSERT(iChar >= 0 && iChar < m_nLength);
+        return m_pch[iChar];
+    }
+
+    // Out-of-range arguments are clamped, as for CStringT::Mid
+    CStringViewT Mid(int iFirst) const noexcept
+    {
+        return Mid(iFirst, m_nLength - iFirst);
+    }
+
+    CStringViewT Mid(int iFirst, int nCount) const noexcept
+    {
+        if (iFirst < 0)
+            iFirst = 0;
+        if (iFirst > m_nLength)
+            iFirst = m_nLength;
+        if (nCount < 0)
+            nCount = 0;
+        if (nCount > m_nLength - iFirst)
+            nCount = m_nLength - iFirst;
+        return CStringViewT(m_pch + iFirst, nCount);
+    }
+
+    CStringViewT Left(int nCount) const noexcept
+    {
+        return Mid(0, nCount);
+    }
+
+    CStringViewT Right(int nCount) const noexcept
+    {
+        if (nCount > m_nLength)
+            nCount = m_nLength;
+        if (nCount < 0)
+            nCount = 0;
+        return CStringViewT(m_pch + m_nLength - nCount, nCount);
+    }
+
+private:
+    const XCHAR* m_pch;
+    int m_nLength;
+};
+
+typedef CStringViewT<char> CStringViewA;
+typedef CStringViewT<wchar_t> CStringViewW;
+typedef CStringViewT<TCHAR> CStringView;
+
+// A string is a single pointer to a heap block; moving it bitwise is safe
+template <typename BaseType>
+class CSimpleRelocateTraits<CSimpleStringT<BaseType>> {
+public:
+    static constexpr bool bTriviallyRelocatable = true;
+};
+
+} // namespace ATL
+
+#endif // __ATLSIMPSTR_H__
@@ -1,5 +1,5 @@
 // OpenATL - Clean-room ATL subset for WTL 10.0
-// String compatibility stub
+// CStringT - copy-on-write CString, CStringA and CStringW
 
 #ifndef __ATLSTR_H__
 #define __ATLSTR_H__
@@ -10,268 +10,1995 @@
 // WTL checks for __ATLSTR_H__ to enable CString-based overloads
 
 #include "atlbase.h"
-#include <string>
+#include "atlsimpstr.h"
+
+#include <cstdarg>
+#include <cwchar>
+#include <cwctype>
+#include <cctype>
 
 namespace ATL {
 
-// Minimal CString implementation for WTL compatibility
-class CString {
+///////////////////////////////////////////////////////////////////////////////
+// _ChTraitsAsciiT - ASCII fast paths for case mapping, trimming and
+// case-insensitive comparison
+//
+// The CRT maps case and classifies white space one character at a time
+// through the current locale. ASCII characters are mapped here instead,
+// with the "C" locale rules, and only other characters go through
+// TChTraits (the CRT). With SSE2, 16 bytes are handled per step: 16 chars
+// or 8 UTF-16 code units. A step that contains a non-ASCII character is
+// finished one character at a time.
+
+template <typename XCHAR, class TChTraits>
+class _ChTraitsAsciiT {
 public:
-    CString() noexcept {}
+    static void StringUppercase(XCHAR* pch, int nLength) noexcept
+    {
+        MapCase<true>(pch, nLength);
+    }
 
-    CString(const TCHAR* psz)
+    static void StringLowercase(XCHAR* pch, int nLength) noexcept
     {
-        if (psz != NULL)
-            m_str = psz;
+        MapCase<false>(pch, nLength);
     }
 
-    CString(const TCHAR* psz, int nLength)
+    // Number of white-space characters at the start of pch[0, nLength)
+    static int StringSpanSpace(const XCHAR* pch, int nLength) noexcept
     {
-        if (psz != NULL && nLength > 0)
-            m_str.assign(psz, nLength);
+        // Most strings have nothing to trim
+        if (nLength == 0 || !IsSpace(pch[0]))
+            return 0;
+
+        int i = 0;
+#ifdef _ATL_SIMPLE_FIND_SSE2
+        if constexpr (bVector) {
+            while (i + nStep <= nLength) {
+                int nMask = _mm_movemask_epi8(SpaceMask(_mm_loadu_si128((const __m128i*)(pch + i))));
+                if (nMask == 0xFFFF) {
+                    i += nStep;
+                    continue;
+                }
+                // The first character that is not ASCII white space
+                i += _AtlSimpleLowestBit(~nMask & 0xFFFF) / (int)sizeof(XCHAR);
+                if (!IsSpace(pch[i]))
+                    return i;
+                i++;
+            }
+        }
+#endif
+        while (i < nLength && IsSpace(pch[i]))
+            i++;
+        return i;
     }
 
-#ifdef UNICODE
-    // Construct from narrow string (ANSI -> UNICODE conversion)
-    CString(const char* psz)
+    // Number of white-space characters at the end of pch[0, nLength)
+    static int StringSpanSpaceRev(const XCHAR* pch, int nLength) noexcept
     {
-        if (psz != NULL) {
-            int len = ::MultiByteToWideChar(CP_ACP, 0, psz, -1, NULL, 0);
-            if (len > 0) {
-                m_str.resize(len - 1);
-                ::MultiByteToWideChar(CP_ACP, 0, psz, -1, &m_str[0], len);
+        if (nLength == 0 || !IsSpace(pch[nLength - 1]))
+            return 0;
+
+        int iEnd = nLength;
+#ifdef _ATL_SIMPLE_FIND_SSE2
+        if constexpr (bVector) {
+            while (iEnd >= nStep) {
+                int nMask = _mm_movemask_epi8(SpaceMask(_mm_loadu_si128((const __m128i*)(pch + iEnd - nStep))));
+                if (nMask != 0xFFFF)
+                    break;
+                iEnd -= nStep;
             }
         }
+#endif
+        while (iEnd > 0 && IsSpace(pch[iEnd - 1]))
+            iEnd--;
+        return nLength - iEnd;
     }
+
+    // Compares as the CRT's case-insensitive comparison does: by the
+    // lowercase form of each character, then by length
+    static int StringCompareIgnoreN(const XCHAR* pch1, int nLength1, const XCHAR* pch2, int nLength2) noexcept
+    {
+        int nMin = (nLength1 < nLength2) ? nLength1 : nLength2;
+        int i = 0;
+#ifdef _ATL_SIMPLE_FIND_SSE2
+        if constexpr (bVector) {
+            for (; i + nStep <= nMin; i += nStep) {
+                __m128i v1 = _mm_loadu_si128((const __m128i*)(pch1 + i));
+                __m128i v2 = _mm_loadu_si128((const __m128i*)(pch2 + i));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
+                    continue;
+                if (IsAscii(_mm_or_si128(v1, v2))) {
+                    int nMask = _mm_movemask_epi8(_mm_cmpeq_epi8(FlipCase(v1, 'A', 'Z'), FlipCase(v2, 'A', 'Z')));
+                    if (nMask == 0xFFFF)
+                        continue;
+                    int j = i + _AtlSimpleLowestBit(~nMask & 0xFFFF) / (int)sizeof(XCHAR);
+                    return CompareChars(ToLower(pch1[j]), ToLower(pch2[j]));
+                }
+                for (int j = i; j < i + nStep; j++) {
+                    int nResult = CompareChars(ToLower(pch1[j]), ToLower(pch2[j]));
+                    if (nResult != 0)
+                        return nResult;
+                }
+            }
+        }
 #endif
+        for (; i < nMin; i++) {
+            int nResult = CompareChars(ToLower(pch1[i]), ToLower(pch2[i]));
+            if (nResult != 0)
+                return nResult;
+        }
+        return (nLength1 < nLength2) ? -1 : (nLength1 > nLength2) ? 1 : 0;
+    }
 
-    CString(const CString& strSrc) : m_str(strSrc.m_str) {}
-    CString(CString&& strSrc) noexcept : m_str(std::move(strSrc.m_str)) {}
+private:
+    typedef typename std::make_unsigned<XCHAR>::type UXCHAR;
 
-    CString(TCHAR ch, int nRepeat = 1)
+    static bool IsAsciiChar(XCHAR ch) noexcept
     {
-        m_str.assign(nRepeat, ch);
+        return (UXCHAR)ch < 0x80;
     }
 
-    ~CString() {}
+    static XCHAR ToUpper(XCHAR ch) noexcept
+    {
+        if (IsAsciiChar(ch))
+            return (ch >= 'a' && ch <= 'z') ? (XCHAR)(ch - 0x20) : ch;
+        return TChTraits::CharToUpper(ch);
+    }
 
-    CString& operator=(const CString& strSrc)
+    static XCHAR ToLower(XCHAR ch) noexcept
     {
-        m_str = strSrc.m_str;
-        return *this;
+        if (IsAsciiChar(ch))
+            return (ch >= 'A' && ch <= 'Z') ? (XCHAR)(ch + 0x20) : ch;
+        return TChTraits::CharToLower(ch);
     }
 
-    CString& operator=(CString&& strSrc) noexcept
+    static bool IsSpace(XCHAR ch) noexcept
     {
-        m_str = std::move(strSrc.m_str);
-        return *this;
+        if (IsAsciiChar(ch))
+            return ch == ' ' || (ch >= '\t' && ch <= '\r');
+        return TChTraits::IsSpace(ch);
+    }
+
+    static int CompareChars(XCHAR ch1, XCHAR ch2) noexcept
+    {
+        return ((UXCHAR)ch1 < (UXCHAR)ch2) ? -1 : ((UXCHAR)ch1 > (UXCHAR)ch2) ? 1 : 0;
     }
 
-    CString& operator=(const TCHAR* psz)
+    template <bool t_bUpper>
+    static void MapCase(XCHAR* pch, int nLength) noexcept
     {
-        if (psz != NULL)
-            m_str = psz;
+        int i = 0;
+#ifdef _ATL_SIMPLE_FIND_SSE2
+        if constexpr (bVector) {
+            for (; i + nStep <= nLength; i += nStep) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(pch + i));
+                if (IsAscii(v)) {
+                    _mm_storeu_si128((__m128i*)(pch + i), t_bUpper ? FlipCase(v, 'a', 'z') : FlipCase(v, 'A', 'Z'));
+                } else {
+                    for (int j = i; j < i + nStep; j++)
+                        pch[j] = t_bUpper ? ToUpper(pch[j]) : ToLower(pch[j]);
+                }
+            }
+        }
+#endif
+        for (; i < nLength; i++)
+            pch[i] = t_bUpper ? ToUpper(pch[i]) : ToLower(pch[i]);
+    }
+
+#ifdef _ATL_SIMPLE_FIND_SSE2
+    // Vectors of 8-bit chars or 16-bit code units; a 32-bit wchar_t stays scalar
+    static constexpr bool bVector = (sizeof(XCHAR) == 1 || sizeof(XCHAR) == 2);
+    static constexpr int nStep = 16 / (int)sizeof(XCHAR);
+
+    static __m128i Splat(int n) noexcept
+    {
+        if constexpr (sizeof(XCHAR) == 1)
+            return _mm_set1_epi8((char)n);
         else
-            m_str.clear();
-        return *this;
+            return _mm_set1_epi16((short)n);
     }
 
-    CString& operator=(TCHAR ch)
+    static bool IsAscii(__m128i v) noexcept
     {
-        m_str = ch;
-        return *this;
+        if constexpr (sizeof(XCHAR) == 1)
+            return _mm_movemask_epi8(v) == 0;
+        else
+            return _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, Splat(0xFF80)), _mm_setzero_si128())) == 0xFFFF;
+    }
+
+    // Lanes holding chLow..chHigh. Signed compares are exact here, because
+    // a lane with the sign bit set is never in an ASCII range.
+    static __m128i InRange(__m128i v, int chLow, int chHigh) noexcept
+    {
+        if constexpr (sizeof(XCHAR) == 1)
+            return _mm_and_si128(_mm_cmpgt_epi8(v, Splat(chLow - 1)), _mm_cmplt_epi8(v, Splat(chHigh + 1)));
+        else
+            return _mm_and_si128(_mm_cmpgt_epi16(v, Splat(chLow - 1)), _mm_cmplt_epi16(v, Splat(chHigh + 1)));
     }
 
-    operator LPCTSTR() const noexcept { return m_str.c_str(); }
+    // Flips the case of the letters chLow..chHigh ('a'..'z' or 'A'..'Z')
+    static __m128i FlipCase(__m128i v, int chLow, int chHigh) noexcept
+    {
+        return _mm_xor_si128(v, _mm_and_si128(InRange(v, chLow, chHigh), Splat(0x20)));
+    }
 
-    int GetLength() const noexcept { return (int)m_str.length(); }
-    bool IsEmpty() const noexcept { return m_str.empty(); }
-    void Empty() { m_str.clear(); }
+    // All bytes set in the lanes that hold ASCII white space
+    static __m128i SpaceMask(__m128i v) noexcept
+    {
+        __m128i vSpace;
+        if constexpr (sizeof(XCHAR) == 1)
+            vSpace = _mm_cmpeq_epi8(v, Splat(' '));
+        else
+            vSpace = _mm_cmpeq_epi16(v, Splat(' '));
+        return _mm_or_si128(vSpace, InRange(v, '\t', '\r'));
+    }
+#endif
+};
 
-    TCHAR GetAt(int nIndex) const { return m_str.at(nIndex); }
-    void SetAt(int nIndex, TCHAR ch) { m_str[nIndex] = ch; }
-    TCHAR operator[](int nIndex) const { return m_str[nIndex]; }
+///////////////////////////////////////////////////////////////////////////////
+// ChTraitsCRT - CRT-backed character operations for CStringT
 
-    CString& operator+=(const CString& strSrc) { m_str += strSrc.m_str; return *this; }
-    CString& operator+=(const TCHAR* psz) { if (psz) m_str += psz; return *this; }
-    CString& operator+=(TCHAR ch) { m_str += ch; return *this; }
+template <typename BaseType>
+class ChTraitsCRT;
 
-    friend CString operator+(const CString& a, const CString& b)
+template <>
+class ChTraitsCRT<wchar_t> : public ChTraitsBase<wchar_t>, public _ChTraitsAsciiT<wchar_t, ChTraitsCRT<wchar_t>> {
+public:
+    static int SafeStringLen(PCXSTR psz) noexcept
     {
-        CString s;
-        s.m_str = a.m_str + b.m_str;
-        return s;
+        return (psz != NULL) ? (int)wcslen(psz) : 0;
     }
 
-    friend CString operator+(const CString& a, const TCHAR* b)
+    static int StringCompare(PCXSTR psz1, PCXSTR psz2) noexcept
     {
-        CString s;
-        s.m_str = a.m_str;
-        if (b) s.m_str += b;
-        return s;
+        return wcscmp(psz1, psz2);
     }
 
-    friend CString operator+(const TCHAR* a, const CString& b)
+    static int StringCompareIgnore(PCXSTR psz1, PCXSTR psz2) noexcept
     {
-        CString s;
-        if (a) s.m_str = a;
-        s.m_str += b.m_str;
-        return s;
+        return _wcsicmp(psz1, psz2);
     }
 
-    int Compare(const TCHAR* psz) const noexcept
+    static PCXSTR StringFindString(PCXSTR pszBlock, PCXSTR pszMatch) noexcept
     {
-        return _tcscmp(m_str.c_str(), psz ? psz : _T(""));
+        return wcsstr(pszBlock, pszMatch);
     }
 
-    int CompareNoCase(const TCHAR* psz) const noexcept
+    static PCXSTR StringFindChar(PCXSTR pszBlock, XCHAR chMatch) noexcept
     {
-        return _tcsicmp(m_str.c_str(), psz ? psz : _T(""));
+        return wcschr(pszBlock, chMatch);
     }
 
-    bool operator==(const TCHAR* psz) const { return Compare(psz) == 0; }
-    bool operator!=(const TCHAR* psz) const { return Compare(psz) != 0; }
-    bool operator<(const TCHAR* psz) const { return Compare(psz) < 0; }
-    bool operator>(const TCHAR* psz) const { return Compare(psz) > 0; }
+    static PCXSTR StringFindCharRev(PCXSTR psz, XCHAR ch) noexcept
+    {
+        return wcsrchr(psz, ch);
+    }
 
-    CString Mid(int nFirst) const { return CString(m_str.substr(nFirst).c_str()); }
-    CString Mid(int nFirst, int nCount) const { return CString(m_str.substr(nFirst, nCount).c_str()); }
-    CString Left(int nCount) const { return CString(m_str.substr(0, nCount).c_str()); }
-    CString Right(int nCount) const { return CString(m_str.substr(m_str.length() - nCount).c_str()); }
+    // Length-bounded forms for strings that need not be NUL-terminated
+    static int StringCompareN(const XCHAR* pch1, const XCHAR* pch2, int nLength) noexcept
+    {
+        return (nLength > 0) ? wmemcmp(pch1, pch2, nLength) : 0;
+    }
 
-    int Find(TCHAR ch, int nStart = 0) const
+    static const XCHAR* StringFindCharN(const XCHAR* pchBlock, int nLength, XCHAR chMatch) noexcept
     {
-        auto pos = m_str.find(ch, nStart);
-        return pos == std::basic_string<TCHAR>::npos ? -1 : (int)pos;
+        return (nLength > 0) ? wmemchr(pchBlock, chMatch, nLength) : NULL;
     }
 
-    int Find(const TCHAR* psz, int nStart = 0) const
+    static XCHAR CharToUpper(XCHAR ch) noexcept
     {
-        if (psz == NULL) return -1;
-        auto pos = m_str.find(psz, nStart);
-        return pos == std::basic_string<TCHAR>::npos ? -1 : (int)pos;
+        return (XCHAR)towupper(ch);
     }
 
-    int ReverseFind(TCHAR ch) const
+    static XCHAR CharToLower(XCHAR ch) noexcept
     {
-        auto pos = m_str.rfind(ch);
-        return pos == std::basic_string<TCHAR>::npos ? -1 : (int)pos;
+        return (XCHAR)towlower(ch);
     }
 
-    CString& MakeUpper() { for (auto& c : m_str) c = (TCHAR)_totupper(c); return *this; }
-    CString& MakeLower() { for (auto& c : m_str) c = (TCHAR)_totlower(c); return *this; }
+    static bool IsSpace(XCHAR ch) noexcept
+    {
+        return iswspace(ch) != 0;
+    }
 
-    CString& TrimLeft()
+    static int GetFormattedLength(PCXSTR pszFormat, va_list args) noexcept
     {
-        auto it = m_str.begin();
-        while (it != m_str.end() && _istspace(*it)) ++it;
-        m_str.erase(m_str.begin(), it);
-        return *this;
+        return _vscwprintf(pszFormat, args);
     }
 
-    CString& TrimRight()
+    static int Format(PXSTR pszBuffer, size_t nLength, PCXSTR pszFormat, va_list args) noexcept
     {
-        auto it = m_str.end();
-        while (it != m_str.begin() && _istspace(*(it - 1))) --it;
-        m_str.erase(it, m_str.end());
-        return *this;
+        return vswprintf_s(pszBuffer, nLength, pszFormat, args);
     }
 
-    CString& Trim() { TrimLeft(); TrimRight(); return *this; }
+    // As Format, but returns -1 instead of failing when the buffer is too small
+    static int FormatBounded(PXSTR pszBuffer, size_t nLength, PCXSTR pszFormat, va_list args) noexcept
+    {
+        return _vsnwprintf_s(pszBuffer, nLength, _TRUNCATE, pszFormat, args);
+    }
 
-    LPTSTR GetBuffer(int nMinBufLength = 0)
+    // Length in characters of psz converted to wchar_t
+    static int GetBaseTypeLength(PCYSTR pszSrc) noexcept
     {
-        if (nMinBufLength > (int)m_str.length())
-            m_str.resize(nMinBufLength);
-        return &m_str[0];
+        return AtlMultiByteToWideChar(CP_ACP, pszSrc, -1, NULL, 0) - 1;
     }
 
-    void ReleaseBuffer(int nNewLength = -1)
+    static int GetBaseTypeLength(PCYSTR pszSrc, int nLength) noexcept
     {
-        if (nNewLength >= 0)
-            m_str.resize(nNewLength);
-        else
-            m_str.resize(_tcslen(m_str.c_str()));
+        return AtlMultiByteToWideChar(CP_ACP, pszSrc, nLength, NULL, 0);
     }
 
-    LPTSTR GetBufferSetLength(int nNewLength)
+    static void ConvertToBaseType(PXSTR pszDest, int nDestLength, PCYSTR pszSrc, int nSrcLength = -1) noexcept
     {
-        m_str.resize(nNewLength);
-        return &m_str[0];
+        AtlMultiByteToWideChar(CP_ACP, pszSrc, nSrcLength, pszDest, nDestLength);
     }
 
-    void __cdecl Format(const TCHAR* pszFormat, ...)
+    static int LoadString(HINSTANCE hInstance, UINT nID, PXSTR pszBuffer, int nBufferMax) noexcept
     {
-        va_list args;
-        va_start(args, pszFormat);
-        FormatV(pszFormat, args);
-        va_end(args);
+        return ::LoadStringW(hInstance, nID, pszBuffer, nBufferMax);
     }
 
-    void FormatV(const TCHAR* pszFormat, va_list args)
+    static BSTR AllocSysString(const XCHAR* pchData, int nDataLength) noexcept
     {
-        int nLen = _vsctprintf(pszFormat, args);
-        if (nLen > 0) {
-            m_str.resize(nLen);
-            _vstprintf_s(&m_str[0], nLen + 1, pszFormat, args);
-        }
+        return ::SysAllocStringLen(pchData, nDataLength);
     }
+};
 
-    BOOL LoadString(UINT nID)
+template <>
+class ChTraitsCRT<char> : public ChTraitsBase<char>, public _ChTraitsAsciiT<char, ChTraitsCRT<char>> {
+public:
+    static int SafeStringLen(PCXSTR psz) noexcept
+    {
+        return (psz != NULL) ? (int)strlen(psz) : 0;
+    }
+
+    static int StringCompare(PCXSTR psz1, PCXSTR psz2) noexcept
+    {
+        return strcmp(psz1, psz2);
+    }
+
+    static int StringCompareIgnore(PCXSTR psz1, PCXSTR psz2) noexcept
+    {
+        return _stricmp(psz1, psz2);
+    }
+
+    static PCXSTR StringFindString(PCXSTR pszBlock, PCXSTR pszMatch) noexcept
+    {
+        return strstr(pszBlock, pszMatch);
+    }
+
+    static PCXSTR StringFindChar(PCXSTR pszBlock, XCHAR chMatch) noexcept
+    {
+        return strchr(pszBlock, chMatch);
+    }
+
+    static PCXSTR StringFindCharRev(PCXSTR psz, XCHAR ch) noexcept
+    {
+        return strrchr(psz, ch);
+    }
+
+    // Length-bounded forms for strings that need not be NUL-terminated
+    static int StringCompareN(const XCHAR* pch1, const XCHAR* pch2, int nLength) noexcept
+    {
+        return (nLength > 0) ? memcmp(pch1, pch2, nLength) : 0;
+    }
+
+    static const XCHAR* StringFindCharN(const XCHAR* pchBlock, int nLength, XCHAR chMatch) noexcept
+    {
+        return (nLength > 0) ? (const XCHAR*)memchr(pchBlock, chMatch, nLength) : NULL;
+    }
+
+    static XCHAR CharToUpper(XCHAR ch) noexcept
+    {
+        return (XCHAR)toupper((unsigned char)ch);
+    }
+
+    static XCHAR CharToLower(XCHAR ch) noexcept
+    {
+        return (XCHAR)tolower((unsigned char)ch);
+    }
+
+    static bool IsSpace(XCHAR ch) noexcept
+    {
+        return isspace((unsigned char)ch) != 0;
+    }
+
+    static int GetFormattedLength(PCXSTR pszFormat, va_list args) noexcept
+    {
+        return _vscprintf(pszFormat, args);
+    }
+
+    static int Format(PXSTR pszBuffer, size_t nLength, PCXSTR pszFormat, va_list args) noexcept
+    {
+        return vsprintf_s(pszBuffer, nLength, pszFormat, args);
+    }
+
+    // As Format, but returns -1 instead of failing when the buffer is too small
+    static int FormatBounded(PXSTR pszBuffer, size_t nLength, PCXSTR pszFormat, va_list args) noexcept
+    {
+        return _vsnprintf_s(pszBuffer, nLength, _TRUNCATE, pszFormat, args);
+    }
+
+    // Length in characters of psz converted to char
+    static int GetBaseTypeLength(PCYSTR pszSrc) noexcept
+    {
+        return AtlWideCharToMultiByte(CP_ACP, pszSrc, -1, NULL, 0) - 1;
+    }
+
+    static int GetBaseTypeLength(PCYSTR pszSrc, int nLength) noexcept
+    {
+        return AtlWideCharToMultiByte(CP_ACP, pszSrc, nLength, NULL, 0);
+    }
+
+    static void ConvertToBaseType(PXSTR pszDest, int nDestLength, PCYSTR pszSrc, int nSrcLength = -1) noexcept
+    {
+        AtlWideCharToMultiByte(CP_ACP, pszSrc, nSrcLength, pszDest, nDestLength);
+    }
+
+    static int LoadString(HINSTANCE hInstance, UINT nID, PXSTR pszBuffer, int nBufferMax) noexcept
+    {
+        return ::LoadStringA(hInstance, nID, pszBuffer, nBufferMax);
+    }
+
+    // Converts with the ANSI code page
+    static BSTR AllocSysString(const XCHAR* pchData, int nDataLength) noexcept
+    {
+        int nLength = (nDataLength > 0) ? AtlMultiByteToWideChar(CP_ACP, pchData, nDataLength, NULL, 0) : 0;
+        BSTR bstr = ::SysAllocStringLen(NULL, nLength);
+        if (bstr != NULL && nLength > 0)
+            AtlMultiByteToWideChar(CP_ACP, pchData, nDataLength, bstr, nLength);
+        return bstr;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// StrTraitATL - string traits used by CString
+
+template <typename BaseType, class StringIterator = ChTraitsCRT<BaseType>>
+class StrTraitATL : public StringIterator {
+public:
+    static IAtlStringMgr* GetDefaultManager() noexcept
+    {
+        return AtlGetDefaultStringMgr();
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CStringT - CSimpleStringT plus searching, case, trimming and formatting
+
+template <typename BaseType, class StringTraits>
+class CStringT : public CSimpleStringT<BaseType> {
+public:
+    typedef CSimpleStringT<BaseType> CThisSimpleString;
+    typedef typename CThisSimpleString::XCHAR XCHAR;
+    typedef typename CThisSimpleString::PXSTR PXSTR;
+    typedef typename CThisSimpleString::PCXSTR PCXSTR;
+    typedef typename CThisSimpleString::YCHAR YCHAR;
+    typedef typename CThisSimpleString::PYSTR PYSTR;
+    typedef typename CThisSimpleString::PCYSTR PCYSTR;
+    typedef CStringViewT<BaseType> CThisStringView;
+
+    CStringT() noexcept : CThisSimpleString(StringTraits::GetDefaultManager())
+    {
+    }
+
+    explicit CStringT(IAtlStringMgr* pStringMgr) noexcept : CThisSimpleString(pStringMgr)
+    {
+    }
+
+    CStringT(const CStringT& strSrc) noexcept : CThisSimpleString(strSrc)
+    {
+    }
+
+    CStringT(CStringT&& strSrc) noexcept : CThisSimpleString(std::move(strSrc))
+    {
+    }
+
+    CStringT(const CThisSimpleString& strSrc) noexcept : CThisSimpleString(strSrc)
+    {
+    }
+
+    CStringT(PCXSTR pszSrc) : CThisSimpleString(pszSrc, StringTraits::GetDefaultManager())
+    {
+    }
+
+    CStringT(PCXSTR pszSrc, IAtlStringMgr* pStringMgr) : CThisSimpleString(pszSrc, pStringMgr)
+    {
+    }
+
+    CStringT(const XCHAR* pchSrc, int nLength) : CStringT(pchSrc, nLength, StringTraits::GetDefaultManager())
+    {
+    }
+
+    CStringT(const XCHAR* pchSrc, int nLength, IAtlStringMgr* pStringMgr)
+        : CThisSimpleString(pchSrc, (pchSrc != NULL && nLength > 0) ? nLength : 0, pStringMgr)
+    {
+    }
+
+    // Converts from the other character type with the ANSI code page
+    CStringT(PCYSTR pszSrc) : CThisSimpleString(StringTraits::GetDefaultManager())
+    {
+        *this = pszSrc;
+    }
+
+    CStringT(const YCHAR* pchSrc, int nLength) : CThisSimpleString(StringTraits::GetDefaultManager())
     {
-        TCHAR szBuf[256];
-        int nLen = ::LoadString(_AtlBaseModule.GetResourceInstance(), nID, szBuf, 256);
-        if (nLen > 0) {
-            m_str.assign(szBuf, nLen);
-            return TRUE;
+        if (pchSrc != NULL && nLength > 0) {
+            int nDestLength = StringTraits::GetBaseTypeLength(pchSrc, nLength);
+            PXSTR pszBuffer = this->GetBuffer(nDestLength);
+            StringTraits::ConvertToBaseType(pszBuffer, nDestLength, pchSrc, nLength);
+            this->ReleaseBufferSetLength(nDestLength);
         }
-        return FALSE;
     }
 
-    int Replace(const TCHAR* pszOld, const TCHAR* pszNew)
+    explicit CStringT(CThisStringView view) : CStringT(view.GetData(), view.GetLength(), StringTraits::GetDefaultManager())
     {
-        if (pszOld == NULL || pszNew == NULL) return 0;
-        int nCount = 0;
-        size_t nOldLen = _tcslen(pszOld);
-        size_t nNewLen = _tcslen(pszNew);
-        size_t pos = 0;
-        while ((pos = m_str.find(pszOld, pos)) != std::basic_string<TCHAR>::npos) {
-            m_str.replace(pos, nOldLen, pszNew);
-            pos += nNewLen;
-            nCount++;
+    }
+
+    CStringT(CThisStringView view, IAtlStringMgr* pStringMgr) : CStringT(view.GetData(), view.GetLength(), pStringMgr)
+    {
+    }
+
+    CStringT(XCHAR ch, int nRepeat = 1) : CThisSimpleString(StringTraits::GetDefaultManager())
+    {
+        if (nRepeat > 0) {
+            PXSTR pszBuffer = this->GetBuffer(nRepeat);
+            for (int i = 0; i < nRepeat; i++)
+                pszBuffer[i] = ch;
+            this->ReleaseBufferSetLength(nRepeat);
         }
-        return nCount;
     }
 
-    int Replace(TCHAR chOld, TCHAR chNew)
+    ~CStringT() noexcept
     {
-        int nCount = 0;
-        for (auto& c : m_str) {
-            if (c == chOld) { c = chNew; nCount++; }
+    }
+
+    CStringT& operator=(const CStringT& strSrc)
+    {
+        CThisSimpleString::operator=(strSrc);
+        return *this;
+    }
+
+    CStringT& operator=(CStringT&& strSrc) noexcept
+    {
+        CThisSimpleString::operator=(std::move(strSrc));
+        return *this;
+    }
+
+    CStringT& operator=(const CThisSimpleString& strSrc)
+    {
+        CThisSimpleString::operator=(strSrc);
+        return *this;
+    }
+
+    CStringT& operator=(PCXSTR pszSrc)
+    {
+        CThisSimpleString::operator=(pszSrc);
+        return *this;
+    }
+
+    CStringT& operator=(PCYSTR pszSrc)
+    {
+        int nDestLength = (pszSrc != NULL) ? StringTraits::GetBaseTypeLength(pszSrc) : 0;
+        if (nDestLength > 0) {
+            PXSTR pszBuffer = this->GetBuffer(nDestLength);
+            StringTraits::ConvertToBaseType(pszBuffer, nDestLength + 1, pszSrc);
+            this->ReleaseBufferSetLength(nDestLength);
+        } else {
+            this->Empty();
         }
-        return nCount;
+        return *this;
     }
 
-    int Delete(int nIndex, int nCount = 1)
+    CStringT& operator=(CThisStringView view)
     {
-        m_str.erase(nIndex, nCount);
-        return (int)m_str.length();
+        this->SetString(view.GetData(), view.GetLength());
+        return *this;
     }
 
-    int Insert(int nIndex, TCHAR ch)
+    CStringT& operator=(XCHAR ch)
     {
-        m_str.insert(m_str.begin() + nIndex, ch);
-        return (int)m_str.length();
+        XCHAR ach[2] = { ch, 0 };
+        this->SetString(ach, 1);
+        return *this;
     }
 
-    int Insert(int nIndex, const TCHAR* psz)
+    CStringT& operator+=(const CThisSimpleString& strSrc)
     {
-        if (psz) m_str.insert(nIndex, psz);
-        return (int)m_str.length();
+        CThisSimpleString::operator+=(strSrc);
+        return *this;
     }
 
-private:
-    std::basic_string<TCHAR> m_str;
+    CStringT& operator+=(PCXSTR pszSrc)
+    {
+        CThisSimpleString::operator+=(pszSrc);
+        return *this;
+    }
+
+    CStringT& operator+=(XCHAR ch)
+    {
+        CThisSimpleString::operator+=(ch);
+        return *this;
+    }
+
+    CStringT& operator+=(CThisStringView view)
+    {
+        this->Append(view.GetData(), view.GetLength());
+        return *this;
+    }
+
+    // Comparison
+
+    int Compare(PCXSTR psz) const noexcept
+    {
+        return StringTraits::StringCompare(this->GetString(), (psz != NULL) ? psz : GetEmptyString());
+    }
+
+    int CompareNoCase(PCXSTR psz) const noexcept
+    {
+        return CompareNoCase(CThisStringView((psz != NULL) ? psz : GetEmptyString()));
+    }
+
+    // Views and strings compare by length and contents, without a strlen
+    int Compare(CThisStringView view) const noexcept
+    {
+        int nLength = this->GetLength();
+        int nViewLength = view.GetLength();
+        int nResult = StringTraits::StringCompareN(this->GetString(), view.GetData(), (nLength < nViewLength) ? nLength : nViewLength);
+        if (nResult != 0)
+            return nResult;
+        return (nLength < nViewLength) ? -1 : (nLength > nViewLength) ? 1 : 0;
+    }
+
+    int Compare(const CThisSimpleString& str) const noexcept
+    {
+        return Compare(CThisStringView(str));
+    }
+
+    int CompareNoCase(CThisStringView view) const noexcept
+    {
+        return StringTraits::StringCompareIgnoreN(this->GetString(), this->GetLength(), view.GetData(), view.GetLength());
+    }
+
+    int CompareNoCase(const CThisSimpleString& str) const noexcept
+    {
+        return CompareNoCase(CThisStringView(str));
+    }
+
+    // Substrings; out-of-range arguments are clamped
+
+    CStringT Mid(int iFirst) const
+    {
+        return Mid(iFirst, this->GetLength() - iFirst);
+    }
+
+    CStringT Mid(int iFirst, int nCount) const
+    {
+        int nLength = this->GetLength();
+        if (iFirst < 0)
+            iFirst = 0;
+        if (iFirst > nLength)
+            iFirst = nLength;
+        if (nCount < 0)
+            nCount = 0;
+        if (nCount > nLength - iFirst)
+            nCount = nLength - iFirst;
+
+        // The whole string is a copy that shares the buffer
+        if (iFirst == 0 && nCount == nLength)
+            return *this;
+        return CStringT(this->GetString() + iFirst, nCount, this->GetManager());
+    }
+
+    CStringT Left(int nCount) const
+    {
+        return Mid(0, nCount);
+    }
+
+    CStringT Right(int nCount) const
+    {
+        int nLength = this->GetLength();
+        if (nCount > nLength)
+            nCount = nLength;
+        if (nCount < 0)
+            nCount = 0;
+        return Mid(nLength - nCount, nCount);
+    }
+
+    // Substrings as views into this string; nothing is allocated or copied,
+    // and the view is invalidated by the next write to this string
+
+    CThisStringView MidView(int iFirst) const noexcept
+    {
+        return CThisStringView(*this).Mid(iFirst);
+    }
+
+    CThisStringView MidView(int iFirst, int nCount) const noexcept
+    {
+        return CThisStringView(*this).Mid(iFirst, nCount);
+    }
+
+    CThisStringView LeftView(int nCount) const noexcept
+    {
+        return CThisStringView(*this).Left(nCount);
+    }
+
+    CThisStringView RightView(int nCount) const noexcept
+    {
+        return CThisStringView(*this).Right(nCount);
+    }
+
+    // Searching
+
+    int Find(XCHAR ch, int iStart = 0) const noexcept
+    {
+        if (iStart < 0 || iStart >= this->GetLength())
+            return -1;
+        PCXSTR psz = StringTraits::StringFindChar(this->GetString() + iStart, ch);
+        return (psz != NULL) ? (int)(psz - this->GetString()) : -1;
+    }
+
+    int Find(PCXSTR pszSub, int iStart = 0) const noexcept
+    {
+        if (pszSub == NULL || iStart < 0 || iStart > this->GetLength())
+            return -1;
+        PCXSTR psz = StringTraits::StringFindString(this->GetString() + iStart, pszSub);
+        return (psz != NULL) ? (int)(psz - this->GetString()) : -1;
+    }
+
+    int Find(CThisStringView view, int iStart = 0) const noexcept
+    {
+        int nLength = this->GetLength();
+        int nViewLength = view.GetLength();
+        if (iStart < 0 || iStart > nLength)
+            return -1;
+        if (nViewLength == 0)
+            return iStart;
+        return FindRun(this->GetString(), nLength, iStart, view.GetData(), nViewLength, NULL);
+    }
+
+    int Find(const CThisSimpleString& str, int iStart = 0) const noexcept
+    {
+        return Find(CThisStringView(str), iStart);
+    }
+
+    int ReverseFind(XCHAR ch) const noexcept
+    {
+        PCXSTR psz = StringTraits::StringFindCharRev(this->GetString(), ch);
+        return (psz != NULL) ? (int)(psz - this->GetString()) : -1;
+    }
+
+    // Case
+
+    CStringT& MakeUpper()
+    {
+        int nLength = this->GetLength();
+        if (nLength == 0)
+            return *this;
+        PXSTR pszBuffer = this->GetBuffer(nLength);
+        StringTraits::StringUppercase(pszBuffer, nLength);
+        this->ReleaseBufferSetLength(nLength);
+        return *this;
+    }
+
+    CStringT& MakeLower()
+    {
+        int nLength = this->GetLength();
+        if (nLength == 0)
+            return *this;
+        PXSTR pszBuffer = this->GetBuffer(nLength);
+        StringTraits::StringLowercase(pszBuffer, nLength);
+        this->ReleaseBufferSetLength(nLength);
+        return *this;
+    }
+
+    // Trimming
+
+    CStringT& TrimLeft()
+    {
+        int nLength = this->GetLength();
+        int iFirst = StringTraits::StringSpanSpace(this->GetString(), nLength);
+        if (iFirst != 0) {
+            int nNewLength = nLength - iFirst;
+            PXSTR pszBuffer = this->GetBuffer(nLength);
+            CThisSimpleString::CopyCharsOverlapped(pszBuffer, pszBuffer + iFirst, nNewLength);
+            this->ReleaseBufferSetLength(nNewLength);
+        }
+        return *this;
+    }
+
+    CStringT& TrimRight()
+    {
+        int nLength = this->GetLength();
+        int nNewLength = nLength - StringTraits::StringSpanSpaceRev(this->GetString(), nLength);
+        if (nNewLength != nLength)
+            this->Truncate(nNewLength);
+        return *this;
+    }
+
+    CStringT& Trim()
+    {
+        return TrimRight().TrimLeft();
+    }
+
+    // Formatting and resources
+
+    void __cdecl Format(PCXSTR pszFormat, ...)
+    {
+        va_list args;
+        va_start(args, pszFormat);
+        FormatV(pszFormat, args);
+        va_end(args);
+    }
+
+    // Formats into a stack buffer first, so the common short result parses
+    // the format once; only a result that does not fit is measured and
+    // formatted again into a heap buffer. The arguments may point into
+    // this string.
+    void FormatV(PCXSTR pszFormat, va_list args)
+    {
+        ATLASSERT(pszFormat != NULL);
+        if (pszFormat == NULL)
+            AtlThrow(E_INVALIDARG);
+
+        // Each pass consumes a va_list, so each works on a copy
+        XCHAR szBuffer[_nFormatStackLength];
+        va_list argsCopy;
+        va_copy(argsCopy, args);
+        int nLength = StringTraits::FormatBounded(szBuffer, _nFormatStackLength, pszFormat, argsCopy);
+        va_end(argsCopy);
+        if (nLength >= 0) {
+            this->SetString(szBuffer, nLength);
+            return;
+        }
+
+        va_copy(argsCopy, args);
+        nLength = StringTraits::GetFormattedLength(pszFormat, argsCopy);
+        va_end(argsCopy);
+        if (nLength <= 0) {
+            this->Empty();
+            return;
+        }
+
+        CStringT strResult(this->GetManager());
+        PXSTR pszBuffer = strResult.GetBuffer(nLength);
+        va_copy(argsCopy, args);
+        StringTraits::Format(pszBuffer, nLength + 1, pszFormat, argsCopy);
+        va_end(argsCopy);
+        strResult.ReleaseBufferSetLength(nLength);
+        AttachResult(strResult);
+    }
+
+    // Type-safe formatting without the CRT printf machinery
+    //
+    // The format uses printf syntax: flags (- 0 + space #), width and
+    // precision (digits or *), size prefixes (which are ignored), and the
+    // conversions d i u o x X c s S p and %%. Each argument is formatted
+    // according to its C++ type, so a size prefix cannot disagree with
+    // the argument. Integers, characters, pointers, strings of either
+    // character type, CSimpleStringT and CStringViewT are formatted here.
+    // Floating-point arguments (e f g a) are handed to the CRT one at a
+    // time. A conversion that does not suit its argument asserts and
+    // formats the argument in its default form.
+    template <typename... TArgs>
+    void FormatT(PCXSTR pszFormat, const TArgs&... args)
+    {
+        ATLASSERT(pszFormat != NULL);
+        if (pszFormat == NULL)
+            AtlThrow(E_INVALIDARG);
+
+        const _FormatArg aArgs[sizeof...(TArgs) + 1] = { MakeFormatArg(args)..., _FormatArg() };
+        FormatArgs(pszFormat, aArgs, (int)sizeof...(TArgs));
+    }
+
+    BOOL LoadString(UINT nID)
+    {
+        return LoadString(_AtlBaseModule.GetResourceInstance(), nID);
+    }
+
+    // Copies straight out of the module's string table, so strings of any
+    // length load whole
+    BOOL LoadString(HINSTANCE hInstance, UINT nID)
+    {
+        return LoadString(hInstance, nID, 0);
+    }
+
+    BOOL LoadString(HINSTANCE hInstance, UINT nID, WORD wLanguage)
+    {
+        LPCWSTR pch;
+        int nLength = AtlGetStringResourceView(hInstance, nID, &pch, wLanguage);
+        if (nLength == 0)
+            return FALSE;
+        SetResourceString(pch, nLength);
+        return TRUE;
+    }
+
+    // Returns a new BSTR holding the string; the caller frees it
+    BSTR AllocSysString() const
+    {
+        BSTR bstr = StringTraits::AllocSysString(this->GetString(), this->GetLength());
+        if (bstr == NULL)
+            AtlThrow(E_OUTOFMEMORY);
+        return bstr;
+    }
+
+    // Editing
+
+    // Replaces every occurrence of pszOld with pszNew; returns the count
+    //
+    // The first pass counts the matches, the second copies the segments
+    // between them into a single new buffer, so the cost is linear in the
+    // length of the string whatever the number of matches.
+    int Replace(PCXSTR pszOld, PCXSTR pszNew)
+    {
+        int nOldLength = StringTraits::SafeStringLen(pszOld);
+        if (nOldLength == 0)
+            return 0;
+        int nNewLength = StringTraits::SafeStringLen(pszNew);
+
+        PCXSTR psz = this->GetString();
+        int nLength = this->GetLength();
+        if (nOldLength > nLength)
+            return 0;
+
+        int anSkip[256];
+        const int* pnSkip = NULL;
+        if (nOldLength >= _nSkipTableMinLength) {
+            BuildSkipTable(anSkip, pszOld, nOldLength);
+            pnSkip = anSkip;
+        }
+
+        int nCount = 0;
+        for (int i = 0; (i = FindRun(psz, nLength, i, pszOld, nOldLength, pnSkip)) >= 0; i += nOldLength)
+            nCount++;
+        if (nCount == 0)
+            return 0;
+
+        long long nResultLength = nLength + (long long)nCount * (nNewLength - nOldLength);
+        if (nResultLength > INT_MAX)
+            AtlThrow(E_OUTOFMEMORY);
+
+        // Build into a new buffer; pszNew and pszOld may point into this string
+        CStringT strResult(this->GetManager());
+        PXSTR pszResult = strResult.GetBuffer((int)nResultLength);
+        PXSTR pchDest = pszResult;
+        int iCopy = 0;
+        for (int i = 0; (i = FindRun(psz, nLength, i, pszOld, nOldLength, pnSkip)) >= 0; i += nOldLength) {
+            CThisSimpleString::CopyChars(pchDest, psz + iCopy, i - iCopy);
+            pchDest += i - iCopy;
+            CThisSimpleString::CopyChars(pchDest, pszNew, nNewLength);
+            pchDest += nNewLength;
+            iCopy = i + nOldLength;
+        }
+        CThisSimpleString::CopyChars(pchDest, psz + iCopy, nLength - iCopy);
+        strResult.ReleaseBufferSetLength((int)nResultLength);
+
+        AttachResult(strResult);
+        return nCount;
+    }
+
+    int Replace(XCHAR chOld, XCHAR chNew)
+    {
+        int nLength = this->GetLength();
+        int iFirst = Find(chOld);
+        if (iFirst < 0)
+            return 0;
+
+        int nCount = 0;
+        PXSTR pszBuffer = this->GetBuffer(nLength);
+        for (int i = iFirst; i < nLength; i++) {
+            if (pszBuffer[i] == chOld) {
+                pszBuffer[i] = chNew;
+                nCount++;
+            }
+        }
+        this->ReleaseBufferSetLength(nLength);
+        return nCount;
+    }
+
+    // Removes nCount characters at iIndex; returns the new length
+    int Delete(int iIndex, int nCount = 1)
+    {
+        int nLength = this->GetLength();
+        if (iIndex < 0)
+            iIndex = 0;
+        if (nCount > nLength - iIndex)
+            nCount = nLength - iIndex;
+        if (nCount > 0) {
+            int nNewLength = nLength - nCount;
+            PXSTR pszBuffer = this->GetBuffer(nLength);
+            CThisSimpleString::CopyCharsOverlapped(pszBuffer + iIndex, pszBuffer + iIndex + nCount, nNewLength - iIndex);
+            this->ReleaseBufferSetLength(nNewLength);
+        }
+        return this->GetLength();
+    }
+
+    // Inserts before iIndex; returns the new length
+    int Insert(int iIndex, XCHAR ch)
+    {
+        XCHAR ach[2] = { ch, 0 };
+        return Insert(iIndex, ach);
+    }
+
+    int Insert(int iIndex, PCXSTR psz)
+    {
+        int nLength = this->GetLength();
+        if (iIndex < 0)
+            iIndex = 0;
+        if (iIndex > nLength)
+            iIndex = nLength;
+
+        int nInsertLength = StringTraits::SafeStringLen(psz);
+        if (nInsertLength > 0) {
+            // psz may point into this string, which GetBuffer can move
+            PCXSTR pszOld = this->GetString();
+            if (psz >= pszOld && psz <= pszOld + nLength) {
+                CStringT strCopy(psz, nInsertLength);
+                return Insert(iIndex, strCopy.GetString());
+            }
+
+            int nNewLength = nLength + nInsertLength;
+            PXSTR pszBuffer = this->GetBuffer(nNewLength);
+            CThisSimpleString::CopyCharsOverlapped(pszBuffer + iIndex + nInsertLength, pszBuffer + iIndex, nLength - iIndex);
+            CThisSimpleString::CopyChars(pszBuffer + iIndex, psz, nInsertLength);
+            this->ReleaseBufferSetLength(nNewLength);
+        }
+        return this->GetLength();
+    }
+
+    // Concatenation
+    //
+    // A temporary left operand is extended in place, so a chain such as
+    // a + b + c grows one buffer instead of copying the partial result at
+    // every step. CStringBuilderT::Concat sizes the result up front.
+
+    friend CStringT operator+(CStringT&& str1, const CStringT& str2)
+    {
+        str1.Append(str2);
+        return std::move(str1);
+    }
+
+    friend CStringT operator+(CStringT&& str1, PCXSTR psz2)
+    {
+        str1.Append(psz2);
+        return std::move(str1);
+    }
+
+    friend CStringT operator+(CStringT&& str1, XCHAR ch2)
+    {
+        str1.AppendChar(ch2);
+        return std::move(str1);
+    }
+
+    friend CStringT operator+(CStringT&& str1, CThisStringView view2)
+    {
+        str1.Append(view2.GetData(), view2.GetLength());
+        return std::move(str1);
+    }
+
+    friend CStringT operator+(const CStringT& str1, const CStringT& str2)
+    {
+        CStringT strResult(str1.GetManager());
+        CThisSimpleString::Concatenate(strResult, str1.GetString(), str1.GetLength(), str2.GetString(), str2.GetLength());
+        return strResult;
+    }
+
+    friend CStringT operator+(const CStringT& str1, PCXSTR psz2)
+    {
+        CStringT strResult(str1.GetManager());
+        CThisSimpleString::Concatenate(strResult, str1.GetString(), str1.GetLength(), psz2, StringTraits::SafeStringLen(psz2));
+        return strResult;
+    }
+
+    friend CStringT operator+(PCXSTR psz1, const CStringT& str2)
+    {
+        CStringT strResult(str2.GetManager());
+        CThisSimpleString::Concatenate(strResult, psz1, StringTraits::SafeStringLen(psz1), str2.GetString(), str2.GetLength());
+        return strResult;
+    }
+
+    friend CStringT operator+(const CStringT& str1, XCHAR ch2)
+    {
+        CStringT strResult(str1.GetManager());
+        CThisSimpleString::Concatenate(strResult, str1.GetString(), str1.GetLength(), &ch2, 1);
+        return strResult;
+    }
+
+    friend CStringT operator+(XCHAR ch1, const CStringT& str2)
+    {
+        CStringT strResult(str2.GetManager());
+        CThisSimpleString::Concatenate(strResult, &ch1, 1, str2.GetString(), str2.GetLength());
+        return strResult;
+    }
+
+    friend CStringT operator+(const CStringT& str1, CThisStringView view2)
+    {
+        CStringT strResult(str1.GetManager());
+        CThisSimpleString::Concatenate(strResult, str1.GetString(), str1.GetLength(), view2.GetData(), view2.GetLength());
+        return strResult;
+    }
+
+    friend CStringT operator+(CThisStringView view1, const CStringT& str2)
+    {
+        CStringT strResult(str2.GetManager());
+        CThisSimpleString::Concatenate(strResult, view1.GetData(), view1.GetLength(), str2.GetString(), str2.GetLength());
+        return strResult;
+    }
+
+    // Relational operators
+
+    friend bool operator==(const CStringT& str1, const CStringT& str2) noexcept
+    {
+        return str1.GetLength() == str2.GetLength() && str1.Compare(CThisStringView(str2)) == 0;
+    }
+
+    friend bool operator==(const CStringT& str1, PCXSTR psz2) noexcept
+    {
+        return str1.Compare(psz2) == 0;
+    }
+
+    friend bool operator==(PCXSTR psz1, const CStringT& str2) noexcept
+    {
+        return str2.Compare(psz1) == 0;
+    }
+
+    friend bool operator==(const CStringT& str1, CThisStringView view2) noexcept
+    {
+        return str1.GetLength() == view2.GetLength() && str1.Compare(view2) == 0;
+    }
+
+    friend bool operator==(CThisStringView view1, const CStringT& str2) noexcept
+    {
+        return str2 == view1;
+    }
+
+    friend bool operator!=(const CStringT& str1, const CStringT& str2) noexcept
+    {
+        return !(str1 == str2);
+    }
+
+    friend bool operator!=(const CStringT& str1, CThisStringView view2) noexcept
+    {
+        return !(str1 == view2);
+    }
+
+    friend bool operator!=(CThisStringView view1, const CStringT& str2) noexcept
+    {
+        return !(str2 == view1);
+    }
+
+    friend bool operator!=(const CStringT& str1, PCXSTR psz2) noexcept
+    {
+        return str1.Compare(psz2) != 0;
+    }
+
+    friend bool operator!=(PCXSTR psz1, const CStringT& str2) noexcept
+    {
+        return str2.Compare(psz1) != 0;
+    }
+
+    friend bool operator<(const CStringT& str1, const CStringT& str2) noexcept
+    {
+        return str1.Compare(str2) < 0;
+    }
+
+    friend bool operator<(const CStringT& str1, PCXSTR psz2) noexcept
+    {
+        return str1.Compare(psz2) < 0;
+    }
+
+    friend bool operator<(PCXSTR psz1, const CStringT& str2) noexcept
+    {
+        return str2.Compare(psz1) > 0;
+    }
+
+    friend bool operator>(const CStringT& str1, const CStringT& str2) noexcept
+    {
+        return str1.Compare(str2) > 0;
+    }
+
+    friend bool operator>(const CStringT& str1, PCXSTR psz2) noexcept
+    {
+        return str1.Compare(psz2) > 0;
+    }
+
+    friend bool operator>(PCXSTR psz1, const CStringT& str2) noexcept
+    {
+        return str2.Compare(psz1) < 0;
+    }
+
+    friend bool operator<=(const CStringT& str1, const CStringT& str2) noexcept
+    {
+        return str1.Compare(str2) <= 0;
+    }
+
+    friend bool operator<=(const CStringT& str1, PCXSTR psz2) noexcept
+    {
+        return str1.Compare(psz2) <= 0;
+    }
+
+    friend bool operator<=(PCXSTR psz1, const CStringT& str2) noexcept
+    {
+        return str2.Compare(psz1) >= 0;
+    }
+
+    friend bool operator>=(const CStringT& str1, const CStringT& str2) noexcept
+    {
+        return str1.Compare(str2) >= 0;
+    }
+
+    friend bool operator>=(const CStringT& str1, PCXSTR psz2) noexcept
+    {
+        return str1.Compare(psz2) >= 0;
+    }
+
+    friend bool operator>=(PCXSTR psz1, const CStringT& str2) noexcept
+    {
+        return str2.Compare(psz1) <= 0;
+    }
+
+private:
+    // Patterns this long are searched with a Horspool skip table
+    enum { _nSkipTableMinLength = 8 };
+
+    // Characters FormatV tries on the stack before measuring
+    enum { _nFormatStackLength = 512 };
+
+    void SetResourceString(LPCWSTR pchSrc, int nSrcLength)
+    {
+        if constexpr (sizeof(XCHAR) == sizeof(WCHAR)) {
+            this->SetString((PCXSTR)pchSrc, nSrcLength);
+        } else {
+            int nLength = StringTraits::GetBaseTypeLength(pchSrc, nSrcLength);
+            PXSTR pszBuffer = this->GetBuffer(nLength);
+            StringTraits::ConvertToBaseType(pszBuffer, nLength, pchSrc, nSrcLength);
+            this->ReleaseBufferSetLength(nLength);
+        }
+    }
+
+    // Takes over the buffer of a freshly built result. A locked buffer stays
+    // in place for whoever holds the pointer, and gets a copy instead.
+    void AttachResult(CStringT& strResult)
+    {
+        if (this->GetData()->IsLocked())
+            this->SetString(strResult.GetString(), strResult.GetLength());
+        else
+            *this = std::move(strResult);
+    }
+
+    // One FormatT argument, with its type erased to a kind
+    struct _FormatArg {
+        enum { kNone, kSigned, kUnsigned, kChar, kString, kOtherString, kDouble, kPointer };
+
+        int nKind;
+        int nSize;      // bytes in the integer, or characters in the string (-1 = NUL-terminated)
+        union {
+            long long nSigned;
+            unsigned long long nUnsigned;
+            double dValue;
+            const void* pValue;
+            const XCHAR* pchString;
+            PCYSTR pszOther;
+        };
+
+        _FormatArg() noexcept : nKind(kNone), nSize(0), nUnsigned(0)
+        {
+        }
+    };
+
+    template <typename T>
+    struct _FormatArgUnsupported : std::false_type {
+    };
+
+    template <typename T>
+    static _FormatArg MakeFormatArg(const T& t) noexcept
+    {
+        typedef typename std::decay<T>::type TArg;
+        _FormatArg arg;
+        if constexpr (std::is_base_of<CThisSimpleString, TArg>::value) {
+            arg.nKind = _FormatArg::kString;
+            arg.pchString = t.GetString();
+            arg.nSize = t.GetLength();
+        } else if constexpr (std::is_base_of<CSimpleStringT<YCHAR>, TArg>::value) {
+            arg.nKind = _FormatArg::kOtherString;
+            arg.pszOther = t.GetString();
+        } else if constexpr (std::is_same<TArg, CThisStringView>::value) {
+            arg.nKind = _FormatArg::kString;
+            arg.pchString = t.GetData();
+            arg.nSize = t.GetLength();
+        } else if constexpr (std::is_same<TArg, XCHAR*>::value || std::is_same<TArg, const XCHAR*>::value) {
+            arg.nKind = _FormatArg::kString;
+            arg.pchString = t;
+            arg.nSize = -1;
+        } else if constexpr (std::is_same<TArg, YCHAR*>::value || std::is_same<TArg, const YCHAR*>::value) {
+            arg.nKind = _FormatArg::kOtherString;
+            arg.pszOther = t;
+        } else if constexpr (std::is_same<TArg, XCHAR>::value) {
+            arg.nKind = _FormatArg::kChar;
+            arg.nUnsigned = (typename std::make_unsigned<XCHAR>::type)t;
+        } else if constexpr (std::is_same<TArg, bool>::value) {
+            arg.nKind = _FormatArg::kUnsigned;
+            arg.nUnsigned = t ? 1 : 0;
+            arg.nSize = sizeof(int);
+        } else if constexpr (std::is_integral<TArg>::value && std::is_signed<TArg>::value) {
+            arg.nKind = _FormatArg::kSigned;
+            arg.nSigned = t;
+            arg.nSize = sizeof(TArg);
+        } else if constexpr (std::is_integral<TArg>::value) {
+            arg.nKind = _FormatArg::kUnsigned;
+            arg.nUnsigned = t;
+            arg.nSize = sizeof(TArg);
+        } else if constexpr (std::is_enum<TArg>::value) {
+            return MakeFormatArg((typename std::underlying_type<TArg>::type)t);
+        } else if constexpr (std::is_floating_point<TArg>::value) {
+            arg.nKind = _FormatArg::kDouble;
+            arg.dValue = (double)t;
+        } else if constexpr (std::is_pointer<TArg>::value || std::is_null_pointer<TArg>::value) {
+            arg.nKind = _FormatArg::kPointer;
+            arg.pValue = (const void*)t;
+        } else {
+            static_assert(_FormatArgUnsupported<TArg>::value, "FormatT: unsupported argument type");
+        }
+        return arg;
+    }
+
+    // FormatT output: collected on the stack, and moved to the heap string
+    // only when it outgrows the stack buffer
+    class _FormatWriter {
+    public:
+        explicit _FormatWriter(IAtlStringMgr* pStringMgr) noexcept : m_str(pStringMgr), m_nBuffer(0)
+        {
+        }
+
+        void Append(const XCHAR* pch, int nLength)
+        {
+            if (nLength <= 0)
+                return;
+            if (m_nBuffer + nLength > _nFormatStackLength) {
+                Flush();
+                if (nLength > _nFormatStackLength) {
+                    m_str.Append(pch, nLength);
+                    return;
+                }
+            }
+            CThisSimpleString::CopyChars(m_achBuffer + m_nBuffer, pch, nLength);
+            m_nBuffer += nLength;
+        }
+
+        void Fill(XCHAR ch, int nCount)
+        {
+            while (nCount > 0) {
+                if (m_nBuffer == _nFormatStackLength)
+                    Flush();
+                int nChunk = _nFormatStackLength - m_nBuffer;
+                if (nChunk > nCount)
+                    nChunk = nCount;
+                for (int i = 0; i < nChunk; i++)
+                    m_achBuffer[m_nBuffer + i] = ch;
+                m_nBuffer += nChunk;
+                nCount -= nChunk;
+            }
+        }
+
+        // Appends pchPrefix, nZeros zeros and pchBody padded to nWidth: on
+        // the right for '-', with zeros between prefix and body when
+        // bZeroPad, else with spaces on the left
+        void Field(const XCHAR* pchPrefix, int nPrefix, const XCHAR* pchBody, int nBody, int nWidth, bool bLeft, bool bZeroPad, int nZeros = 0)
+        {
+            int nPad = (nWidth - nPrefix - nBody > nZeros) ? nWidth - nPrefix - nBody - nZeros : 0;
+            if (!bLeft && !bZeroPad)
+                Fill(' ', nPad);
+            Append(pchPrefix, nPrefix);
+            if (!bLeft && bZeroPad)
+                Fill('0', nPad);
+            Fill('0', nZeros);
+            Append(pchBody, nBody);
+            if (bLeft)
+                Fill(' ', nPad);
+        }
+
+        void Flush()
+        {
+            m_str.Append(m_achBuffer, m_nBuffer);
+            m_nBuffer = 0;
+        }
+
+        // Stores the output in str; short output costs a single allocation
+        void Finish(CStringT& str)
+        {
+            if (m_str.IsEmpty()) {
+                str.SetString(m_achBuffer, m_nBuffer);
+            } else {
+                Flush();
+                str.AttachResult(m_str);
+            }
+        }
+
+    private:
+        CStringT m_str;
+        int m_nBuffer;
+        XCHAR m_achBuffer[_nFormatStackLength];
+    };
+
+    static XCHAR* WriteDecimal(XCHAR* pch, int n) noexcept
+    {
+        XCHAR achDigits[12];
+        int nDigits = 0;
+        do {
+            achDigits[nDigits++] = (XCHAR)('0' + n % 10);
+            n /= 10;
+        } while (n != 0);
+        while (nDigits > 0)
+            *pch++ = achDigits[--nDigits];
+        return pch;
+    }
+
+    static int ReadNumber(PCXSTR& psz) noexcept
+    {
+        int n = 0;
+        while (*psz >= '0' && *psz <= '9') {
+            if (n < INT_MAX / 10)
+                n = n * 10 + (*psz - '0');
+            psz++;
+        }
+        return n;
+    }
+
+    static int ArgToInt(const _FormatArg* pArg) noexcept
+    {
+        ATLASSERT(pArg->nKind == _FormatArg::kSigned || pArg->nKind == _FormatArg::kUnsigned);
+        if (pArg->nKind == _FormatArg::kSigned)
+            return (int)pArg->nSigned;
+        if (pArg->nKind == _FormatArg::kUnsigned)
+            return (int)pArg->nUnsigned;
+        return 0;
+    }
+
+    void FormatArgs(PCXSTR pszFormat, const _FormatArg* pArgs, int nArgs)
+    {
+        _FormatWriter writer(this->GetManager());
+
+        int iArg = 0;
+        PCXSTR psz = pszFormat;
+        while (*psz != 0) {
+            // Copy the literal run up to the next '%'
+            PCXSTR pszRun = psz;
+            while (*psz != 0 && *psz != '%')
+                psz++;
+            writer.Append(pszRun, (int)(psz - pszRun));
+            if (*psz == 0)
+                break;
+
+            psz++;
+            if (*psz == '%') {
+                writer.Append(psz, 1);
+                psz++;
+                continue;
+            }
+
+            // Flags, width, precision
+            bool bLeft = false, bZeroPad = false, bPlus = false, bSpace = false, bAlt = false;
+            for (;; psz++) {
+                if (*psz == '-')
+                    bLeft = true;
+                else if (*psz == '0')
+                    bZeroPad = true;
+                else if (*psz == '+')
+                    bPlus = true;
+                else if (*psz == ' ')
+                    bSpace = true;
+                else if (*psz == '#')
+                    bAlt = true;
+                else
+                    break;
+            }
+            int nWidth = 0;
+            if (*psz == '*') {
+                psz++;
+                nWidth = (iArg < nArgs) ? ArgToInt(&pArgs[iArg++]) : 0;
+                if (nWidth < 0) {
+                    bLeft = true;
+                    nWidth = (nWidth == INT_MIN) ? INT_MAX : -nWidth;
+                }
+            } else {
+                nWidth = ReadNumber(psz);
+            }
+            int nPrecision = -1;
+            if (*psz == '.') {
+                psz++;
+                if (*psz == '*') {
+                    psz++;
+                    nPrecision = (iArg < nArgs) ? ArgToInt(&pArgs[iArg++]) : 0;
+                    if (nPrecision < 0)
+                        nPrecision = -1;
+                } else {
+                    nPrecision = ReadNumber(psz);
+                }
+            }
+
+            // Size prefixes; the argument's own type decides the size
+            while (*psz == 'h' || *psz == 'l' || *psz == 'L' || *psz == 'w' || *psz == 'z' || *psz == 'j' || *psz == 't' || *psz == 'q')
+                psz++;
+            if (*psz == 'I') {
+                psz++;
+                if ((psz[0] == '6' && psz[1] == '4') || (psz[0] == '3' && psz[1] == '2'))
+                    psz += 2;
+            }
+
+            XCHAR chConv = *psz;
+            if (chConv == 0)
+                break;
+            psz++;
+
+            ATLASSERT(iArg < nArgs);
+            if (iArg >= nArgs)
+                continue;
+            const _FormatArg& arg = pArgs[iArg++];
+
+            // Map the conversion onto the argument's kind
+            bool bInteger = (arg.nKind == _FormatArg::kSigned || arg.nKind == _FormatArg::kUnsigned || arg.nKind == _FormatArg::kChar);
+            bool bFits;
+            switch (chConv) {
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c': case 'C':
+                bFits = bInteger;
+                break;
+            case 's': case 'S':
+                bFits = (arg.nKind == _FormatArg::kString || arg.nKind == _FormatArg::kOtherString);
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                bFits = (arg.nKind == _FormatArg::kDouble);
+                break;
+            case 'p':
+                // Strings are pointers too; %p prints their address
+                bFits = (arg.nKind == _FormatArg::kPointer || arg.nKind == _FormatArg::kString || arg.nKind == _FormatArg::kOtherString);
+                break;
+            default:
+                bFits = false;
+                break;
+            }
+            if (!bFits) {
+                ATLASSERT(FALSE);
+                static const char s_achDefault[] = { 0, 'd', 'u', 'c', 's', 's', 'g', 'p' };
+                chConv = s_achDefault[arg.nKind];
+            }
+
+            switch (chConv) {
+            case 's': case 'S':
+                if (arg.nKind == _FormatArg::kOtherString) {
+                    CStringT strConverted(arg.pszOther);
+                    int nLength = strConverted.GetLength();
+                    if (nPrecision >= 0 && nPrecision < nLength)
+                        nLength = nPrecision;
+                    writer.Field(NULL, 0, strConverted.GetString(), nLength, nWidth, bLeft, false);
+                } else if (arg.pchString == NULL) {
+                    static const XCHAR s_achNull[] = { '(', 'n', 'u', 'l', 'l', ')' };
+                    writer.Field(NULL, 0, s_achNull, 6, nWidth, bLeft, false);
+                } else {
+                    int nLength = arg.nSize;
+                    if (nLength < 0)
+                        nLength = (nPrecision >= 0) ? CThisSimpleString::StringLengthN(arg.pchString, nPrecision) : CThisSimpleString::StringLength(arg.pchString);
+                    else if (nPrecision >= 0 && nPrecision < nLength)
+                        nLength = nPrecision;
+                    writer.Field(NULL, 0, arg.pchString, nLength, nWidth, bLeft, false);
+                }
+                break;
+
+            case 'c': case 'C': {
+                XCHAR ch = (XCHAR)arg.nUnsigned;
+                writer.Field(NULL, 0, &ch, 1, nWidth, bLeft, false);
+                break;
+            }
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+                // Hand the single conversion to the CRT, rebuilt from the
+                // parsed values so that '*' and size prefixes drop out
+                XCHAR szSpec[40];
+                XCHAR* pchSpec = szSpec;
+                *pchSpec++ = '%';
+                if (bLeft)
+                    *pchSpec++ = '-';
+                if (bZeroPad)
+                    *pchSpec++ = '0';
+                if (bPlus)
+                    *pchSpec++ = '+';
+                if (bSpace)
+                    *pchSpec++ = ' ';
+                if (bAlt)
+                    *pchSpec++ = '#';
+                pchSpec = WriteDecimal(pchSpec, nWidth);
+                if (nPrecision >= 0) {
+                    *pchSpec++ = '.';
+                    pchSpec = WriteDecimal(pchSpec, nPrecision);
+                }
+                *pchSpec++ = chConv;
+                *pchSpec = 0;
+
+                CStringT strValue(this->GetManager());
+                strValue.Format(szSpec, arg.dValue);
+                writer.Append(strValue.GetString(), strValue.GetLength());
+                break;
+            }
+
+            default: {
+                // Integers and pointers: digits are written backwards, and
+                // the zeros that precision asks for are added by Field
+                XCHAR achDigits[24];
+                XCHAR* pchEnd = achDigits + 24;
+                XCHAR* pch = pchEnd;
+                XCHAR achPrefix[2];
+                int nPrefix = 0;
+
+                unsigned long long nValue;
+                bool bNegative = false;
+                bool bSigned = (chConv == 'd' || chConv == 'i');
+                if (chConv == 'p') {
+                    if (arg.nKind == _FormatArg::kString)
+                        nValue = (unsigned long long)(UINT_PTR)arg.pchString;
+                    else if (arg.nKind == _FormatArg::kOtherString)
+                        nValue = (unsigned long long)(UINT_PTR)arg.pszOther;
+                    else
+                        nValue = (unsigned long long)(UINT_PTR)arg.pValue;
+                    nPrecision = (int)sizeof(void*) * 2;
+                    chConv = 'X';
+                } else if (arg.nKind == _FormatArg::kSigned && bSigned) {
+                    bNegative = (arg.nSigned < 0);
+                    nValue = bNegative ? 0 - (unsigned long long)arg.nSigned : (unsigned long long)arg.nSigned;
+                } else {
+                    // A negative value under u/o/x wraps at the argument's own width
+                    nValue = arg.nUnsigned;
+                    if (arg.nKind == _FormatArg::kSigned && arg.nSize < 8)
+                        nValue &= (1ull << (arg.nSize * 8)) - 1;
+                }
+
+                unsigned nBase = (chConv == 'o') ? 8 : (chConv == 'x' || chConv == 'X') ? 16 : 10;
+                const char* pszDigits = (chConv == 'x') ? "0123456789abcdef" : "0123456789ABCDEF";
+                for (unsigned long long n = nValue; n != 0; n /= nBase)
+                    *--pch = (XCHAR)pszDigits[n % nBase];
+                if (pch == pchEnd && nPrecision != 0)
+                    *--pch = '0';
+                int nDigits = (int)(pchEnd - pch);
+                int nZeros = (nPrecision > nDigits) ? nPrecision - nDigits : 0;
+
+                // Sign flags apply to signed conversions only
+                if (bNegative)
+                    achPrefix[nPrefix++] = '-';
+                else if (bSigned && bPlus)
+                    achPrefix[nPrefix++] = '+';
+                else if (bSigned && bSpace)
+                    achPrefix[nPrefix++] = ' ';
+                if (bAlt) {
+                    if (nBase == 16 && nValue != 0) {
+                        achPrefix[nPrefix++] = '0';
+                        achPrefix[nPrefix++] = (XCHAR)chConv;
+                    } else if (nBase == 8 && nZeros == 0 && (nDigits == 0 || *pch != '0')) {
+                        // '#' makes the first octal digit a zero, even for %#.0o of 0
+                        nZeros = 1;
+                    }
+                }
+                writer.Field(achPrefix, nPrefix, pch, nDigits, nWidth, bLeft, bZeroPad && nPrecision < 0, nZeros);
+                break;
+            }
+            }
+        }
+        ATLASSERT(iArg == nArgs);
+
+        writer.Finish(*this);
+    }
+
+    static PCXSTR GetEmptyString() noexcept
+    {
+        static const XCHAR chNil = 0;
+        return &chNil;
+    }
+
+    // Horspool shifts, indexed by the low byte of the character under the
+    // end of the window. Characters that share a low byte share the
+    // smallest shift, which keeps the table valid for wide characters.
+    static void BuildSkipTable(int* pnSkip, const XCHAR* pchPattern, int nPatternLength) noexcept
+    {
+        for (int i = 0; i < 256; i++)
+            pnSkip[i] = nPatternLength;
+        for (int i = 0; i < nPatternLength - 1; i++)
+            pnSkip[(BYTE)pchPattern[i]] = nPatternLength - 1 - i;
+    }
+
+    // Finds the first occurrence of the pattern in pch[iStart, nLength);
+    // returns its index or -1. Without a skip table the CRT's vectorized
+    // memchr/wmemchr scans for the first character, and each candidate is
+    // then compared in full.
+    static int FindRun(const XCHAR* pch, int nLength, int iStart, const XCHAR* pchPattern, int nPatternLength, const int* pnSkip) noexcept
+    {
+        int iLast = nLength - nPatternLength;
+        if (pnSkip != NULL) {
+            XCHAR chLast = pchPattern[nPatternLength - 1];
+            for (int i = iStart; i <= iLast; ) {
+                XCHAR ch = pch[i + nPatternLength - 1];
+                if (ch == chLast && StringTraits::StringCompareN(pch + i, pchPattern, nPatternLength - 1) == 0)
+                    return i;
+                i += pnSkip[(BYTE)ch];
+            }
+            return -1;
+        }
+
+        for (int i = iStart; i <= iLast; i++) {
+            const XCHAR* pchHit = StringTraits::StringFindCharN(pch + i, iLast - i + 1, pchPattern[0]);
+            if (pchHit == NULL)
+                break;
+            i = (int)(pchHit - pch);
+            if (StringTraits::StringCompareN(pchHit + 1, pchPattern + 1, nPatternLength - 1) == 0)
+                return i;
+        }
+        return -1;
+    }
+};
+
+typedef CStringT<wchar_t, StrTraitATL<wchar_t, ChTraitsCRT<wchar_t>>> CStringW;
+typedef CStringT<char, StrTraitATL<char, ChTraitsCRT<char>>> CStringA;
+typedef CStringT<TCHAR, StrTraitATL<TCHAR, ChTraitsCRT<TCHAR>>> CString;
+
+///////////////////////////////////////////////////////////////////////////////
+// CStringBuilderT - assembles a string from many pieces
+//
+// Append copies each piece into one buffer that doubles when full, which
+// skips the unshare and terminate steps that CStringT::Append repeats on
+// every call. When done, Detach hands the buffer over as a CStringT
+// without copying. ToString and ToBSTR each make one exact-size copy and
+// leave the builder intact.
+//
+//     CStringBuilder sb;
+//     for (int i = 0; i < nLines; i++)
+//         sb.Append(aLines[i]).AppendChar(_T('\n'));
+//     CString strReport = sb.Detach();
+//
+// Concat joins a fixed list of pieces with a single allocation:
+//
+//     CString strPath = CStringBuilder::Concat(strDir, _T('\\'), strName, _T(".log"));
+
+template <typename BaseType, class StringTraits>
+class CStringBuilderT {
+public:
+    typedef CStringT<BaseType, StringTraits> CThisString;
+    typedef typename CThisString::CThisSimpleString CThisSimpleString;
+    typedef typename CThisString::CThisStringView CThisStringView;
+    typedef typename CThisString::XCHAR XCHAR;
+    typedef typename CThisString::PXSTR PXSTR;
+    typedef typename CThisString::PCXSTR PCXSTR;
+
+    CStringBuilderT() noexcept : m_str(StringTraits::GetDefaultManager()), m_pch(NULL), m_nLength(0), m_nCapacity(0)
+    {
+    }
+
+    explicit CStringBuilderT(IAtlStringMgr* pStringMgr) noexcept : m_str(pStringMgr), m_pch(NULL), m_nLength(0), m_nCapacity(0)
+    {
+    }
+
+    explicit CStringBuilderT(int nCapacity) : CStringBuilderT()
+    {
+        Reserve(nCapacity);
+    }
+
+    CStringBuilderT(const CStringBuilderT&) = delete;
+    CStringBuilderT& operator=(const CStringBuilderT&) = delete;
+
+    int GetLength() const noexcept
+    {
+        return m_nLength;
+    }
+
+    bool IsEmpty() const noexcept
+    {
+        return m_nLength == 0;
+    }
+
+    // The contents so far; valid until the next Append
+    CThisStringView GetView() const noexcept
+    {
+        return CThisStringView(m_pch, m_nLength);
+    }
+
+    // Drops the contents but keeps the buffer
+    void Clear() noexcept
+    {
+        m_nLength = 0;
+    }
+
+    void Reserve(int nCapacity)
+    {
+        if (nCapacity > m_nCapacity)
+            Realloc(nCapacity);
+    }
+
+    CStringBuilderT& Append(const XCHAR* pch, int nLength)
+    {
+        ATLASSERT(nLength >= 0);
+        if (nLength <= 0)
+            return *this;
+        if (nLength > m_nCapacity - m_nLength) {
+            // pch may point into the buffer that Grow is about to move
+            UINT_PTR nOffset = (UINT_PTR)(pch - m_pch);
+            bool bInside = (m_pch != NULL && nOffset < (UINT_PTR)m_nLength);
+            Grow(nLength);
+            if (bInside)
+                pch = m_pch + nOffset;
+        }
+        CThisSimpleString::CopyChars(m_pch + m_nLength, pch, nLength);
+        m_nLength += nLength;
+        return *this;
+    }
+
+    CStringBuilderT& Append(PCXSTR psz)
+    {
+        return Append(psz, CThisSimpleString::StringLength(psz));
+    }
+
+    CStringBuilderT& Append(const CThisSimpleString& str)
+    {
+        return Append(str.GetString(), str.GetLength());
+    }
+
+    CStringBuilderT& Append(CThisStringView view)
+    {
+        return Append(view.GetData(), view.GetLength());
+    }
+
+    CStringBuilderT& AppendChar(XCHAR ch)
+    {
+        if (m_nLength == m_nCapacity)
+            Grow(1);
+        m_pch[m_nLength++] = ch;
+        return *this;
+    }
+
+    CStringBuilderT& AppendChar(XCHAR ch, int nRepeat)
+    {
+        if (nRepeat <= 0)
+            return *this;
+        if (nRepeat > m_nCapacity - m_nLength)
+            Grow(nRepeat);
+        for (int i = 0; i < nRepeat; i++)
+            m_pch[m_nLength + i] = ch;
+        m_nLength += nRepeat;
+        return *this;
+    }
+
+    CThisString ToString() const
+    {
+        return CThisString(m_pch, m_nLength, m_str.GetManager());
+    }
+
+    CComBSTR ToBSTR() const
+    {
+        CComBSTR bstr;
+        bstr.Attach(StringTraits::AllocSysString(m_pch, m_nLength));
+        if (bstr.m_str == NULL)
+            AtlThrow(E_OUTOFMEMORY);
+        return bstr;
+    }
+
+    // Returns the contents without copying and leaves the builder empty
+    CThisString Detach()
+    {
+        if (m_pch != NULL)
+            m_str.ReleaseBufferSetLength(m_nLength);
+        m_pch = NULL;
+        m_nLength = 0;
+        m_nCapacity = 0;
+        CThisString strResult(std::move(m_str));
+        return strResult;
+    }
+
+    // Joins strings, views, NUL-terminated strings and characters, sizing
+    // the result once
+    template <typename... TArgs>
+    static CThisString Concat(const TArgs&... args)
+    {
+        static_assert(sizeof...(TArgs) > 0, "Concat needs at least one piece");
+        const _Piece aPieces[] = { _Piece(args)... };
+
+        long long nTotal = 0;
+        for (const _Piece& piece : aPieces)
+            nTotal += piece.nLength;
+        if (nTotal > INT_MAX)
+            AtlThrow(E_OUTOFMEMORY);
+
+        CThisString strResult;
+        PXSTR pch = strResult.GetBuffer((int)nTotal);
+        for (const _Piece& piece : aPieces) {
+            if (piece.pch != NULL)
+                CThisSimpleString::CopyChars(pch, piece.pch, piece.nLength);
+            else
+                *pch = piece.ch;
+            pch += piece.nLength;
+        }
+        strResult.ReleaseBufferSetLength((int)nTotal);
+        return strResult;
+    }
+
+private:
+    CThisString m_str;      // owns the buffer; its length is brought up to date only to grow
+    PXSTR m_pch;
+    int m_nLength;
+    int m_nCapacity;
+
+    // One Concat argument; a single character has no pointer. NULL strings
+    // and empty views point at an empty string instead, so that NULL
+    // marks only characters.
+    struct _Piece {
+        const XCHAR* pch;
+        int nLength;
+        XCHAR ch;
+
+        _Piece(const CThisSimpleString& str) noexcept : pch(str.GetString()), nLength(str.GetLength()), ch(0)
+        {
+        }
+
+        _Piece(PCXSTR psz) noexcept : pch(NonNull(psz)), nLength(CThisSimpleString::StringLength(psz)), ch(0)
+        {
+        }
+
+        _Piece(CThisStringView view) noexcept : pch(NonNull(view.GetData())), nLength(view.GetLength()), ch(0)
+        {
+        }
+
+        // Exactly XCHAR, so that an integer such as a count does not
+        // silently become a character
+        template <typename TChar, typename = typename std::enable_if<std::is_same<TChar, XCHAR>::value>::type>
+        _Piece(TChar chPiece) noexcept : pch(NULL), nLength(1), ch(chPiece)
+        {
+        }
+
+        static const XCHAR* NonNull(const XCHAR* pch) noexcept
+        {
+            static const XCHAR chNil = 0;
+            return (pch != NULL) ? pch : &chNil;
+        }
+    };
+
+    void Grow(int nMore)
+    {
+        if (nMore > INT_MAX - m_nLength)
+            AtlThrow(E_OUTOFMEMORY);
+        int nNeeded = m_nLength + nMore;
+        int nCapacity = (m_nCapacity < INT_MAX / 2) ? m_nCapacity * 2 : INT_MAX;
+        if (nCapacity < 64)
+            nCapacity = 64;
+        Realloc((nCapacity > nNeeded) ? nCapacity : nNeeded);
+    }
+
+    void Realloc(int nCapacity)
+    {
+        // The string's own length tells a reallocating manager what to keep
+        if (m_pch != NULL)
+            m_str.ReleaseBufferSetLength(m_nLength);
+        m_pch = m_str.GetBuffer(nCapacity);
+        m_nCapacity = m_str.GetAllocLength();
+    }
+};
+
+typedef CStringBuilderT<wchar_t, StrTraitATL<wchar_t, ChTraitsCRT<wchar_t>>> CStringBuilderW;
+typedef CStringBuilderT<char, StrTraitATL<char, ChTraitsCRT<char>>> CStringBuilderA;
+typedef CStringBuilderT<TCHAR, StrTraitATL<TCHAR, ChTraitsCRT<TCHAR>>> CStringBuilder;
+
+// CStringT adds no data members to CSimpleStringT
+template <typename BaseType, class StringTraits>
+class CSimpleRelocateTraits<CStringT<BaseType, StringTraits>> {
+public:
+    static constexpr bool bTriviallyRelocatable = true;
+};
+
+// Lets CSimpleHashMap key on strings: FNV-1a over the characters
+template <typename BaseType, class StringTraits>
+class CSimpleHashHelper<CStringT<BaseType, StringTraits>> {
+public:
+    static UINT Hash(const CStringT<BaseType, StringTraits>& str)
+    {
+        UINT nHash = 2166136261u;
+        const BaseType* psz = str.GetString();
+        for (int i = 0; i < str.GetLength(); i++) {
+            nHash ^= (UINT)psz[i];
+            nHash *= 16777619u;
+        }
+        return nHash;
+    }
 };
 
 } // namespace ATL
@@ -0,0 +1,344 @@
+// OpenATL - Clean-room ATL subset for WTL 10.0
+// UTF-8 <-> UTF-16 transcoding
+
+#ifndef __ATLUTF8_H__
+#define __ATLUTF8_H__
+
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_M_AMD64) || defined(__x86_64__) || defined(__amd64__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define _ATL_UTF8_SSE2
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define _ATL_UTF8_NEON
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+namespace ATL {
+
+///////////////////////////////////////////////////////////////////////////////
+// UTF-8 / UTF-16 transcoding
+//
+// This header needs no Windows declarations, so it builds and can be
+// tested on any platform. TWide is the type that holds UTF-16 code units:
+// WCHAR on Windows, char16_t elsewhere. The vector paths are used only
+// when TWide is 16 bits wide.
+//
+// Runs of ASCII are converted 16 or 32 characters at a time with SSE2,
+// AVX2 or NEON. Everything else is decoded one sequence at a time.
+// Malformed input is replaced with U+FFFD one maximal subpart at a time,
+// as MultiByteToWideChar and WideCharToMultiByte do. Malformed input
+// means overlong forms, encoded surrogates, out-of-range or truncated
+// sequences, and unpaired surrogates.
+
+// Marks a malformed sequence inside the decoder; written out as U+FFFD
+const uint32_t _nAtlUtf8Invalid = 0xFFFFFFFF;
+
+// Copies the leading ASCII run of p, at most nLength bytes, to pOut as
+// UTF-16 and returns its length
+template <bool t_bWrite, typename TWide>
+inline int _AtlUtf8WidenAscii(const uint8_t* p, int nLength, TWide* pOut) noexcept
+{
+    int i = 0;
+    if constexpr (sizeof(TWide) == 2) {
+#if defined(_ATL_UTF8_SSE2)
+#ifdef __AVX2__
+        for (; i + 32 <= nLength; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+            if (_mm256_movemask_epi8(v) != 0)
+                break;
+            if constexpr (t_bWrite) {
+                _mm256_storeu_si256((__m256i*)(pOut + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+                _mm256_storeu_si256((__m256i*)(pOut + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+            }
+        }
+#endif
+        const __m128i vZero = _mm_setzero_si128();
+        for (; i + 16 <= nLength; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+            if (_mm_movemask_epi8(v) != 0)
+                break;
+            if constexpr (t_bWrite) {
+                _mm_storeu_si128((__m128i*)(pOut + i), _mm_unpacklo_epi8(v, vZero));
+                _mm_storeu_si128((__m128i*)(pOut + i + 8), _mm_unpackhi_epi8(v, vZero));
+            }
+        }
+#elif defined(_ATL_UTF8_NEON)
+        for (; i + 16 <= nLength; i += 16) {
+            uint8x16_t v = vld1q_u8(p + i);
+            if (vmaxvq_u8(v) >= 0x80)
+                break;
+            if constexpr (t_bWrite) {
+                vst1q_u16((uint16_t*)(pOut + i), vmovl_u8(vget_low_u8(v)));
+                vst1q_u16((uint16_t*)(pOut + i + 8), vmovl_high_u8(v));
+            }
+        }
+#endif
+    }
+    for (; i < nLength && p[i] < 0x80; i++) {
+        if constexpr (t_bWrite)
+            pOut[i] = (TWide)p[i];
+    }
+    return i;
+}
+
+// Copies the leading ASCII run of p, at most nLength units, to pOut as
+// UTF-8 and returns its length
+template <bool t_bWrite, typename TWide>
+inline int _AtlUtf16NarrowAscii(const TWide* p, int nLength, uint8_t* pOut) noexcept
+{
+    int i = 0;
+    if constexpr (sizeof(TWide) == 2) {
+#if defined(_ATL_UTF8_SSE2)
+#ifdef __AVX2__
+        const __m256i vHigh256 = _mm256_set1_epi16((short)0xFF80);
+        for (; i + 32 <= nLength; i += 32) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i*)(p + i));
+            __m256i v1 = _mm256_loadu_si256((const __m256i*)(p + i + 16));
+            if (!_mm256_testz_si256(_mm256_or_si256(v0, v1), vHigh256))
+                break;
+            if constexpr (t_bWrite) {
+                // The pack works per 128-bit lane; put the quarters back in order
+                __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xD8);
+                _mm256_storeu_si256((__m256i*)(pOut + i), v);
+            }
+        }
+#endif
+        const __m128i vHigh = _mm_set1_epi16((short)0xFF80);
+        const __m128i vZero = _mm_setzero_si128();
+        for (; i + 16 <= nLength; i += 16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i*)(p + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(p + i + 8));
+            __m128i vAbove = _mm_and_si128(_mm_or_si128(v0, v1), vHigh);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(vAbove, vZero)) != 0xFFFF)
+                break;
+            if constexpr (t_bWrite)
+                _mm_storeu_si128((__m128i*)(pOut + i), _mm_packus_epi16(v0, v1));
+        }
+#elif defined(_ATL_UTF8_NEON)
+        for (; i + 16 <= nLength; i += 16) {
+            uint16x8_t v0 = vld1q_u16((const uint16_t*)(p + i));
+            uint16x8_t v1 = vld1q_u16((const uint16_t*)(p + i + 8));
+            if (vmaxvq_u16(vorrq_u16(v0, v1)) >= 0x80)
+                break;
+            if constexpr (t_bWrite)
+                vst1q_u8(pOut + i, vcombine_u8(vmovn_u16(v0), vmovn_u16(v1)));
+        }
+#endif
+    }
+    for (; i < nLength && (uint32_t)p[i] < 0x80; i++) {
+        if constexpr (t_bWrite)
+            pOut[i] = (uint8_t)p[i];
+    }
+    return i;
+}
+
+// Decodes the sequence at p, whose first byte is not ASCII, and stores the
+// number of bytes it used in *pnUsed. A malformed sequence uses its
+// longest valid prefix, or at least one byte.
+inline uint32_t _AtlUtf8DecodeSequence(const uint8_t* p, const uint8_t* pEnd, int* pnUsed) noexcept
+{
+    uint32_t c = p[0];
+    int nTrail;
+    uint8_t bLow = 0x80;        // range of the second byte
+    uint8_t bHigh = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        nTrail = 1;
+        c &= 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        nTrail = 2;
+        c &= 0x0F;
+        if (c == 0x00)
+            bLow = 0xA0;        // overlong
+        else if (c == 0x0D)
+            bHigh = 0x9F;       // surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        nTrail = 3;
+        c &= 0x07;
+        if (c == 0x00)
+            bLow = 0x90;        // overlong
+        else if (c == 0x04)
+            bHigh = 0x8F;       // above U+10FFFF
+    } else {
+        *pnUsed = 1;
+        return _nAtlUtf8Invalid;
+    }
+
+    int i = 1;
+    for (; i <= nTrail && p + i < pEnd; i++) {
+        uint8_t b = p[i];
+        if (b < bLow || b > bHigh)
+            break;
+        c = (c << 6) | (b & 0x3F);
+        bLow = 0x80;
+        bHigh = 0xBF;
+    }
+    *pnUsed = i;
+    return (i > nTrail) ? c : _nAtlUtf8Invalid;
+}
+
+// Returns the number of UTF-16 units produced, or -1 if they do not fit
+template <bool t_bWrite, typename TWide>
+inline int _AtlUtf8ToUtf16(const uint8_t* p, int nLength, TWide* pOut, int nCapacity, bool* pbValid) noexcept
+{
+    const uint8_t* pEnd = p + nLength;
+    int i = 0;
+    int nOut = 0;
+    bool bValid = true;
+    while (i < nLength) {
+        if (p[i] < 0x80) {
+            int nRun = nLength - i;
+            if (t_bWrite && nRun > nCapacity - nOut)
+                nRun = nCapacity - nOut;
+            int nAscii = _AtlUtf8WidenAscii<t_bWrite>(p + i, nRun, t_bWrite ? pOut + nOut : NULL);
+            if (nAscii == 0)
+                return -1;      // no room left for an ASCII character
+            i += nAscii;
+            nOut += nAscii;
+            continue;
+        }
+
+        int nUsed;
+        uint32_t c = _AtlUtf8DecodeSequence(p + i, pEnd, &nUsed);
+        i += nUsed;
+        if (c == _nAtlUtf8Invalid) {
+            bValid = false;
+            c = 0xFFFD;
+        }
+        if (c >= 0x10000) {
+            if constexpr (t_bWrite) {
+                if (nCapacity - nOut < 2)
+                    return -1;
+                pOut[nOut] = (TWide)(0xD7C0 + (c >> 10));
+                pOut[nOut + 1] = (TWide)(0xDC00 | (c & 0x3FF));
+            }
+            nOut += 2;
+        } else {
+            if constexpr (t_bWrite) {
+                if (nOut == nCapacity)
+                    return -1;
+                pOut[nOut] = (TWide)c;
+            }
+            nOut++;
+        }
+    }
+    if (pbValid != NULL)
+        *pbValid = bValid;
+    return nOut;
+}
+
+// Returns the number of UTF-8 bytes produced, or -1 if they do not fit
+template <bool t_bWrite, typename TWide>
+inline int _AtlUtf16ToUtf8(const TWide* p, int nLength, uint8_t* pOut, int nCapacity) noexcept
+{
+    int i = 0;
+    int nOut = 0;
+    while (i < nLength) {
+        uint32_t c = (uint32_t)p[i];
+        if (c < 0x80) {
+            int nRun = nLength - i;
+            if (t_bWrite && nRun > nCapacity - nOut)
+                nRun = nCapacity - nOut;
+            int nAscii = _AtlUtf16NarrowAscii<t_bWrite>(p + i, nRun, t_bWrite ? pOut + nOut : NULL);
+            if (nAscii == 0 || nAscii > INT_MAX - nOut)
+                return -1;
+            i += nAscii;
+            nOut += nAscii;
+            continue;
+        }
+
+        int nBytes;
+        if (c < 0x800) {
+            nBytes = 2;
+        } else if (c - 0xD800 < 0x800) {
+            uint32_t cLow = (i + 1 < nLength) ? (uint32_t)p[i + 1] : 0;
+            if (c < 0xDC00 && cLow - 0xDC00 < 0x400) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (cLow - 0xDC00);
+                nBytes = 4;
+                i++;
+            } else {
+                c = 0xFFFD;     // unpaired surrogate
+                nBytes = 3;
+            }
+        } else {
+            nBytes = 3;
+        }
+        i++;
+        if (nBytes > INT_MAX - nOut)
+            return -1;
+        if constexpr (t_bWrite) {
+            if (nCapacity - nOut < nBytes)
+                return -1;
+            uint8_t* pb = pOut + nOut;
+            if (nBytes == 2) {
+                pb[0] = (uint8_t)(0xC0 | (c >> 6));
+                pb[1] = (uint8_t)(0x80 | (c & 0x3F));
+            } else if (nBytes == 3) {
+                pb[0] = (uint8_t)(0xE0 | (c >> 12));
+                pb[1] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+                pb[2] = (uint8_t)(0x80 | (c & 0x3F));
+            } else {
+                pb[0] = (uint8_t)(0xF0 | (c >> 18));
+                pb[1] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+                pb[2] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+                pb[3] = (uint8_t)(0x80 | (c & 0x3F));
+            }
+        }
+        nOut += nBytes;
+    }
+    return nOut;
+}
+
+// Converts nLength bytes of UTF-8 to UTF-16. With nCapacity 0, returns
+// the length of the result. Otherwise returns the number of units written
+// to pwch, or 0 if the result does not fit.
+template <typename TWide>
+inline int AtlUtf8ToUtf16(const char* pch, int nLength, TWide* pwch, int nCapacity) noexcept
+{
+    static_assert(sizeof(TWide) >= 2, "TWide must hold a UTF-16 code unit");
+    if (nLength <= 0)
+        return 0;
+    int nResult = (nCapacity == 0)
+        ? _AtlUtf8ToUtf16<false, TWide>((const uint8_t*)pch, nLength, NULL, 0, NULL)
+        : _AtlUtf8ToUtf16<true, TWide>((const uint8_t*)pch, nLength, pwch, nCapacity, NULL);
+    return (nResult > 0) ? nResult : 0;
+}
+
+// Converts nLength UTF-16 units to UTF-8, with the same return values as
+// AtlUtf8ToUtf16
+template <typename TWide>
+inline int AtlUtf16ToUtf8(const TWide* pwch, int nLength, char* pch, int nCapacity) noexcept
+{
+    static_assert(sizeof(TWide) >= 2, "TWide must hold a UTF-16 code unit");
+    if (nLength <= 0)
+        return 0;
+    int nResult = (nCapacity == 0)
+        ? _AtlUtf16ToUtf8<false, TWide>(pwch, nLength, NULL, 0)
+        : _AtlUtf16ToUtf8<true, TWide>(pwch, nLength, (uint8_t*)pch, nCapacity);
+    return (nResult > 0) ? nResult : 0;
+}
+
+// True if the nLength bytes at pch are well-formed UTF-8
+inline bool AtlUtf8IsValid(const char* pch, int nLength) noexcept
+{
+    bool bValid = true;
+    if (nLength > 0)
+        _AtlUtf8ToUtf16<false, char16_t>((const uint8_t*)pch, nLength, NULL, 0, &bValid);
+    return bValid;
+}
+
+} // namespace ATL
+
+#endif // __ATLUTF8_H__
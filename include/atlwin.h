@@ -13,6 +13,10 @@
 #include <shellapi.h>
 #include <errno.h>
 
+#ifdef _ATL_MSG_PROFILE
+#include <intrin.h>
+#endif
+
 // WM_FORWARDMSG - used by WTL for message forwarding
 #ifndef WM_FORWARDMSG
 #define WM_FORWARDMSG 0x037F
@@ -136,6 +140,126 @@ public:
     virtual BOOL ProcessWindowMessage(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult, DWORD dwMsgMapID) = 0;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// CAtlThunkHeap - shared executable memory for window procedure thunks
+//
+// Thunks are carved out of 64 KB executable chunks in fixed-size slots
+// instead of each taking a whole VirtualAlloc granule. Free slots are kept
+// on an interlocked singly linked list, so allocating and releasing a
+// thunk never takes a lock; a new chunk is only committed when the list
+// runs dry. Chunks are never returned to the system.
+//
+// By default chunks are plain RWX pages. Define _ATL_THUNK_NO_RWX to back
+// each chunk with a pagefile section mapped twice instead: an RX view that
+// the thunks execute from and an RW view that they are written through.
+// No page is ever writable and executable at once, and filling a thunk
+// needs no VirtualProtect call.
+//
+// The first slot of every chunk holds a _ChunkHeader so that either view
+// of a slot can be translated to the other. The free list links slots
+// through their writable addresses.
+
+class CAtlThunkHeap {
+public:
+    enum {
+        THUNK_SLOT_SIZE = 32,       // multiple of MEMORY_ALLOCATION_ALIGNMENT
+        THUNK_CHUNK_SIZE = 0x10000  // one allocation granule
+    };
+
+    CAtlThunkHeap() noexcept
+    {
+        ::InitializeSListHead(&m_listFree);
+    }
+
+    // Returns the executable address of a free slot
+    void* Allocate() noexcept
+    {
+        BYTE* pWrite = (BYTE*)::InterlockedPopEntrySList(&m_listFree);
+        if (pWrite == NULL) {
+            pWrite = AllocateChunk();
+            if (pWrite == NULL)
+                return NULL;
+        }
+        const _ChunkHeader* pHeader = GetChunkHeader(pWrite);
+        return pHeader->pExec + (pWrite - pHeader->pWrite);
+    }
+
+    void Free(void* pThunk) noexcept
+    {
+        if (pThunk != NULL)
+            ::InterlockedPushEntrySList(&m_listFree, (PSLIST_ENTRY)GetWritableAddress(pThunk));
+    }
+
+    // Maps the executable address of a slot to the address it is written through
+    static void* GetWritableAddress(void* pThunk) noexcept
+    {
+        const _ChunkHeader* pHeader = GetChunkHeader(pThunk);
+        return pHeader->pWrite + ((BYTE*)pThunk - pHeader->pExec);
+    }
+
+private:
+    struct _ChunkHeader {
+        BYTE* pExec;
+        BYTE* pWrite;
+    };
+
+    static const _ChunkHeader* GetChunkHeader(void* pSlot) noexcept
+    {
+        // Both VirtualAlloc and MapViewOfFile return granule-aligned bases
+        return (const _ChunkHeader*)((ULONG_PTR)pSlot & ~(ULONG_PTR)(THUNK_CHUNK_SIZE - 1));
+    }
+
+    // Commits a new chunk and returns the writable address of its first free slot
+    BYTE* AllocateChunk() noexcept
+    {
+#ifdef _ATL_THUNK_NO_RWX
+        HANDLE hSection = ::CreateFileMappingW(INVALID_HANDLE_VALUE, NULL,
+            PAGE_EXECUTE_READWRITE | SEC_COMMIT, 0, THUNK_CHUNK_SIZE, NULL);
+        if (hSection == NULL)
+            return NULL;
+
+        BYTE* pExec = (BYTE*)::MapViewOfFile(hSection, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, THUNK_CHUNK_SIZE);
+        BYTE* pWrite = (BYTE*)::MapViewOfFile(hSection, FILE_MAP_WRITE, 0, 0, THUNK_CHUNK_SIZE);
+        // The views keep the section alive
+        ::CloseHandle(hSection);
+
+        if (pExec == NULL || pWrite == NULL) {
+            if (pExec != NULL)
+                ::UnmapViewOfFile(pExec);
+            if (pWrite != NULL)
+                ::UnmapViewOfFile(pWrite);
+            return NULL;
+        }
+#else
+        BYTE* pExec = (BYTE*)::VirtualAlloc(NULL, THUNK_CHUNK_SIZE,
+            MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        if (pExec == NULL)
+            return NULL;
+        BYTE* pWrite = pExec;
+#endif
+
+        _ChunkHeader* pHeader = (_ChunkHeader*)pWrite;
+        pHeader->pExec = pExec;
+        pHeader->pWrite = pWrite;
+
+        // Slot 0 is the header and slot 1 goes to the caller. The rest are
+        // published highest first so that later pops hand out ascending
+        // addresses. Threads racing here each commit their own chunk,
+        // which is harmless.
+        for (UINT nOffset = THUNK_CHUNK_SIZE - THUNK_SLOT_SIZE; nOffset > THUNK_SLOT_SIZE; nOffset -= THUNK_SLOT_SIZE)
+            ::InterlockedPushEntrySList(&m_listFree, (PSLIST_ENTRY)(pWrite + nOffset));
+
+        return pWrite + THUNK_SLOT_SIZE;
+    }
+
+    SLIST_HEADER m_listFree;
+
+    CAtlThunkHeap(const CAtlThunkHeap&) = delete;
+    CAtlThunkHeap& operator=(const CAtlThunkHeap&) = delete;
+};
+
+__declspec(selectany) CAtlThunkHeap _AtlThunkHeap;
+
 ///////////////////////////////////////////////////////////////////////////////
 // CWndProcThunk - executable thunk for window procedures
 //
@@ -187,50 +311,56 @@ struct CWndProcThunk {
 #error "Unsupported architecture for CWndProcThunk"
 #endif
 
+    static_assert(sizeof(ThunkCode) <= CAtlThunkHeap::THUNK_SLOT_SIZE, "thunk does not fit in a thunk heap slot");
+
     ThunkCode* pThunkCode;
 
     BOOL Init(WNDPROC proc, void* pThis) noexcept
     {
-        // Allocate executable memory
+        // Take a slot from the shared executable thunk heap
         if (pThunkCode == NULL) {
-            pThunkCode = (ThunkCode*)::VirtualAlloc(NULL, sizeof(ThunkCode),
-                MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+            pThunkCode = (ThunkCode*)_AtlThunkHeap.Allocate();
             if (pThunkCode == NULL)
                 return FALSE;
         }
 
-        // Allow writing to executable memory
-        DWORD dwOldProtect = 0;
-        ::VirtualProtect(pThunkCode, sizeof(ThunkCode), PAGE_EXECUTE_READWRITE, &dwOldProtect);
+        // Under _ATL_THUNK_NO_RWX the slot is read-only at pThunkCode and
+        // must be filled through its writable alias
+        ThunkCode* pCode = (ThunkCode*)CAtlThunkHeap::GetWritableAddress(pThunkCode);
 
 #if defined(_M_AMD64) || defined(__x86_64__) || defined(__amd64__)
-        pThunkCode->mov_rcx[0] = 0x48;
-        pThunkCode->mov_rcx[1] = 0xB9;
-        pThunkCode->pThis = (ULONG_PTR)pThis;
-        pThunkCode->mov_rax[0] = 0x48;
-        pThunkCode->mov_rax[1] = 0xB8;
-        pThunkCode->pProc = (ULONG_PTR)proc;
-        pThunkCode->jmp_rax[0] = 0xFF;
-        pThunkCode->jmp_rax[1] = 0xE0;
+        pCode->mov_rcx[0] = 0x48;
+        pCode->mov_rcx[1] = 0xB9;
+        pCode->pThis = (ULONG_PTR)pThis;
+        pCode->mov_rax[0] = 0x48;
+        pCode->mov_rax[1] = 0xB8;
+        pCode->pProc = (ULONG_PTR)proc;
+        pCode->jmp_rax[0] = 0xFF;
+        pCode->jmp_rax[1] = 0xE0;
 #elif defined(_M_IX86) || defined(__i386__)
-        pThunkCode->mov_esp4[0] = 0xC7;
-        pThunkCode->mov_esp4[1] = 0x44;
-        pThunkCode->mov_esp4[2] = 0x24;
-        pThunkCode->mov_esp4[3] = 0x04;
-        pThunkCode->pThis = (DWORD)(ULONG_PTR)pThis;
-        pThunkCode->jmp = 0xE9;
-        pThunkCode->relProc = (DWORD)((ULONG_PTR)proc - ((ULONG_PTR)&pThunkCode->relProc + sizeof(DWORD)));
+        pCode->mov_esp4[0] = 0xC7;
+        pCode->mov_esp4[1] = 0x44;
+        pCode->mov_esp4[2] = 0x24;
+        pCode->mov_esp4[3] = 0x04;
+        pCode->pThis = (DWORD)(ULONG_PTR)pThis;
+        pCode->jmp = 0xE9;
+        // Relative to where the thunk executes, not where it is written
+        pCode->relProc = (DWORD)((ULONG_PTR)proc - ((ULONG_PTR)&pThunkCode->relProc + sizeof(DWORD)));
 #elif defined(_M_ARM64) || defined(__aarch64__)
-        pThunkCode->ldr_x0 = 0x58000060;   // ldr x0, [pc, #12]
-        pThunkCode->ldr_x16 = 0x58000070;  // ldr x16, [pc, #12]
-        pThunkCode->br_x16 = 0xD61F0200;
-        pThunkCode->pThis = (ULONG_PTR)pThis;
-        pThunkCode->pProc = (ULONG_PTR)proc;
+        pCode->ldr_x0 = 0x58000060;   // ldr x0, [pc, #12]
+        pCode->ldr_x16 = 0x58000070;  // ldr x16, [pc, #12]
+        pCode->br_x16 = 0xD61F0200;
+        pCode->pThis = (ULONG_PTR)pThis;
+        pCode->pProc = (ULONG_PTR)proc;
 #endif
 
-        // Restore original protection and flush instruction cache
-        ::VirtualProtect(pThunkCode, sizeof(ThunkCode), dwOldProtect, &dwOldProtect);
+#if defined(_ATL_THUNK_NO_RWX) && !defined(_M_ARM64) && !defined(__aarch64__)
+        // x86 keeps instruction fetch coherent with stores to any alias of
+        // the page, so the W^X path skips the flush and stays syscall-free
+#else
+        // Thunk heap pages are already writable; only the instruction cache needs flushing
         ::FlushInstructionCache(::GetCurrentProcess(), pThunkCode, sizeof(ThunkCode));
+#endif
         return TRUE;
     }
 
@@ -258,7 +388,7 @@ struct CWndProcThunk {
     ~CWndProcThunk()
     {
         if (pThunkCode != NULL) {
-            ::VirtualFree(pThunkCode, 0, MEM_RELEASE);
+            _AtlThunkHeap.Free(pThunkCode);
             pThunkCode = NULL;
         }
     }
@@ -266,6 +396,369 @@ struct CWndProcThunk {
 
 #pragma pack(pop)
 
+#ifdef _ATL_MSG_PROFILE
+
+///////////////////////////////////////////////////////////////////////////////
+// CAtlMsgProfiler - opt-in message dispatch profiler
+//
+// Define _ATL_MSG_PROFILE to time every message that passes through
+// CWindowImplBaseT::WindowProc, CDialogImplBaseT::DialogProc and
+// CContainedWindowT::WindowProc. Samples are keyed on the window class
+// atom and the message. Each key keeps a call count, total and maximum
+// latency, and a log2 latency histogram. Latency is inclusive of nested
+// dispatch and DefWindowProc, and is measured in ticks: the time stamp
+// counter on x86/x64 and QueryPerformanceCounter elsewhere.
+//
+// Each thread records into its own buffer, so the hot path takes no lock
+// and makes no interlocked call. Buffers are linked into a list that
+// Snapshot() walks. The totals it reads can be a sample behind the owning
+// thread. Reset() bumps a generation counter, and each thread clears its
+// own buffer the next time it records. A buffer released by an exiting
+// thread is adopted by the next new thread.
+//
+// Without _ATL_MSG_PROFILE none of this is compiled and the dispatch
+// paths are unchanged.
+
+struct ATL_MSGPROFILE_STAT {
+    enum {
+        HISTOGRAM_BUCKETS = 32,
+        MAX_CLASSNAME = 64
+    };
+
+    ATOM atomClass;
+    WCHAR szClassName[MAX_CLASSNAME];
+    UINT uMsg;
+    ULONGLONG nCount;
+    ULONGLONG nTotalTicks;
+    ULONGLONG nMaxTicks;
+    // Bucket i counts messages that took [2^i, 2^(i+1)) ticks; bucket 0 also holds 0
+    ULONGLONG aHistogram[HISTOGRAM_BUCKETS];
+};
+
+class CAtlMsgProfiler {
+public:
+    enum {
+        SLOTS_PER_THREAD = 1024,    // power of two
+        CLASSES_PER_THREAD = 64
+    };
+
+    CAtlMsgProfiler() noexcept : m_pBuffers(NULL), m_nGeneration(0)
+    {
+    }
+
+    static ULONGLONG GetTicks() noexcept
+    {
+#if defined(_M_AMD64) || defined(__x86_64__) || defined(__amd64__) || defined(_M_IX86) || defined(__i386__)
+        return __rdtsc();
+#else
+        LARGE_INTEGER li;
+        ::QueryPerformanceCounter(&li);
+        return (ULONGLONG)li.QuadPart;
+#endif
+    }
+
+    // Called by CAtlMsgProfileScope before a message dispatches, while the
+    // window still exists. Reads the class name the first time a thread
+    // sees the class.
+    void AddClass(HWND hWnd, ATOM atomClass) noexcept
+    {
+        _ThreadBuffer* pBuffer = GetThreadBuffer();
+        if (pBuffer != NULL)
+            AddClassName(pBuffer, hWnd, atomClass);
+    }
+
+    // Called by CAtlMsgProfileScope when a message finishes dispatching
+    void Record(ATOM atomClass, UINT uMsg, ULONGLONG nTicks) noexcept
+    {
+        _ThreadBuffer* pBuffer = GetThreadBuffer();
+        if (pBuffer == NULL)
+            return;
+
+        LONG nGeneration = m_nGeneration;
+        if (pBuffer->nGeneration != nGeneration) {
+            ClearBuffer(pBuffer);
+            pBuffer->nGeneration = nGeneration;
+        }
+
+        _Slot* pSlot = FindSlot(pBuffer, atomClass, uMsg);
+        if (pSlot == NULL) {
+            pBuffer->nDropped++;
+            return;
+        }
+        if (pSlot->atomClass == 0) {
+            pSlot->uMsg = uMsg;
+            pSlot->atomClass = atomClass;
+        }
+
+        pSlot->nCount++;
+        pSlot->nTotalTicks += nTicks;
+        if (nTicks > pSlot->nMaxTicks)
+            pSlot->nMaxTicks = nTicks;
+        pSlot->aHistogram[GetBucket(nTicks)]++;
+    }
+
+    // Merges every thread's samples into aStats, one entry per class and
+    // message. Returns the number of samples that did not fit in a thread
+    // buffer and were dropped.
+    ULONGLONG Snapshot(CSimpleArray<ATL_MSGPROFILE_STAT>& aStats) const
+    {
+        aStats.RemoveAll();
+        ULONGLONG nDropped = 0;
+        LONG nGeneration = m_nGeneration;
+
+        for (_ThreadBuffer* pBuffer = m_pBuffers; pBuffer != NULL; pBuffer = pBuffer->pNext) {
+            if (pBuffer->nGeneration != nGeneration)
+                continue;
+            nDropped += pBuffer->nDropped;
+
+            for (int iSlot = 0; iSlot < SLOTS_PER_THREAD; iSlot++) {
+                const _Slot& slot = pBuffer->aSlots[iSlot];
+                if (slot.atomClass == 0)
+                    continue;
+
+                int iStat = 0;
+                while (iStat < aStats.GetSize() &&
+                    (aStats[iStat].atomClass != slot.atomClass || aStats[iStat].uMsg != slot.uMsg))
+                    iStat++;
+
+                if (iStat == aStats.GetSize()) {
+                    ATL_MSGPROFILE_STAT stat;
+                    memset(&stat, 0, sizeof(stat));
+                    stat.atomClass = slot.atomClass;
+                    stat.uMsg = slot.uMsg;
+                    GetClassName(pBuffer, slot.atomClass, stat.szClassName);
+                    if (!aStats.Add(stat))
+                        break;
+                }
+
+                ATL_MSGPROFILE_STAT& stat = aStats[iStat];
+                stat.nCount += slot.nCount;
+                stat.nTotalTicks += slot.nTotalTicks;
+                if (slot.nMaxTicks > stat.nMaxTicks)
+                    stat.nMaxTicks = slot.nMaxTicks;
+                for (int iBucket = 0; iBucket < ATL_MSGPROFILE_STAT::HISTOGRAM_BUCKETS; iBucket++)
+                    stat.aHistogram[iBucket] += slot.aHistogram[iBucket];
+            }
+        }
+
+        return nDropped;
+    }
+
+    // Discards all samples; threads clear their buffers lazily
+    void Reset() noexcept
+    {
+        ::InterlockedIncrement(&m_nGeneration);
+    }
+
+    // Writes a snapshot to the debugger output, one line per class and message
+    void Dump() const
+    {
+        CSimpleArray<ATL_MSGPROFILE_STAT> aStats;
+        ULONGLONG nDropped = Snapshot(aStats);
+
+        WCHAR szLine[256];
+        ::OutputDebugStringW(L"class\tmsg\tcount\ttotal\tmean\tmax\thistogram (log2 ticks:count)\n");
+        for (int i = 0; i < aStats.GetSize(); i++) {
+            const ATL_MSGPROFILE_STAT& stat = aStats[i];
+            _snwprintf_s(szLine, _countof(szLine), _TRUNCATE, L"%s\t0x%04X\t%llu\t%llu\t%llu\t%llu\t",
+                stat.szClassName, stat.uMsg, stat.nCount, stat.nTotalTicks,
+                (stat.nCount != 0) ? stat.nTotalTicks / stat.nCount : 0, stat.nMaxTicks);
+            ::OutputDebugStringW(szLine);
+            for (int iBucket = 0; iBucket < ATL_MSGPROFILE_STAT::HISTOGRAM_BUCKETS; iBucket++) {
+                if (stat.aHistogram[iBucket] == 0)
+                    continue;
+                _snwprintf_s(szLine, _countof(szLine), _TRUNCATE, L" %d:%llu", iBucket, stat.aHistogram[iBucket]);
+                ::OutputDebugStringW(szLine);
+            }
+            ::OutputDebugStringW(L"\n");
+        }
+        if (nDropped != 0) {
+            _snwprintf_s(szLine, _countof(szLine), _TRUNCATE, L"%llu samples dropped (thread buffer full)\n", nDropped);
+            ::OutputDebugStringW(szLine);
+        }
+    }
+
+private:
+    struct _Slot {
+        ATOM atomClass;         // 0 while the slot is empty
+        UINT uMsg;
+        ULONGLONG nCount;
+        ULONGLONG nTotalTicks;
+        ULONGLONG nMaxTicks;
+        ULONGLONG aHistogram[ATL_MSGPROFILE_STAT::HISTOGRAM_BUCKETS];
+    };
+
+    struct _ClassName {
+        ATOM atomClass;
+        WCHAR szName[ATL_MSGPROFILE_STAT::MAX_CLASSNAME];
+    };
+
+    struct _ThreadBuffer {
+        _ThreadBuffer* pNext;
+        LONG bInUse;
+        LONG nGeneration;
+        ULONGLONG nDropped;
+        int nClassNames;
+        _ClassName aClassNames[CLASSES_PER_THREAD];
+        _Slot aSlots[SLOTS_PER_THREAD];
+    };
+
+    // Releases the calling thread's buffer when the thread exits
+    struct _ThreadBufferOwner {
+        _ThreadBuffer* pBuffer;
+
+        ~_ThreadBufferOwner()
+        {
+            if (pBuffer != NULL)
+                ::InterlockedExchange(&pBuffer->bInUse, FALSE);
+        }
+    };
+
+    _ThreadBuffer* GetThreadBuffer() noexcept
+    {
+        static thread_local _ThreadBufferOwner s_owner = { NULL };
+        if (s_owner.pBuffer == NULL)
+            s_owner.pBuffer = AcquireBuffer();
+        return s_owner.pBuffer;
+    }
+
+    _ThreadBuffer* AcquireBuffer() noexcept
+    {
+        // Adopt a buffer left behind by a thread that has exited
+        for (_ThreadBuffer* pBuffer = m_pBuffers; pBuffer != NULL; pBuffer = pBuffer->pNext) {
+            if (pBuffer->bInUse == FALSE && ::InterlockedCompareExchange(&pBuffer->bInUse, TRUE, FALSE) == FALSE)
+                return pBuffer;
+        }
+
+        _ThreadBuffer* pBuffer = (_ThreadBuffer*)::VirtualAlloc(NULL, sizeof(_ThreadBuffer),
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (pBuffer == NULL)
+            return NULL;
+
+        // VirtualAlloc returns zeroed pages, so every slot starts empty
+        pBuffer->bInUse = TRUE;
+        pBuffer->nGeneration = m_nGeneration;
+        _ThreadBuffer* pHead;
+        do {
+            pHead = m_pBuffers;
+            pBuffer->pNext = pHead;
+        } while (::InterlockedCompareExchangePointer((void* volatile*)&m_pBuffers, pBuffer, pHead) != pHead);
+        return pBuffer;
+    }
+
+    static void ClearBuffer(_ThreadBuffer* pBuffer) noexcept
+    {
+        pBuffer->nDropped = 0;
+        memset(pBuffer->aSlots, 0, sizeof(pBuffer->aSlots));
+    }
+
+    static _Slot* FindSlot(_ThreadBuffer* pBuffer, ATOM atomClass, UINT uMsg) noexcept
+    {
+        // Fibonacci hashing of the combined key, then linear probing
+        DWORD dwKey = ((DWORD)atomClass << 16) ^ uMsg;
+        UINT iSlot = (UINT)((dwKey * 2654435769u) >> 22) & (SLOTS_PER_THREAD - 1);
+        for (int nProbe = 0; nProbe < SLOTS_PER_THREAD; nProbe++) {
+            _Slot* pSlot = &pBuffer->aSlots[iSlot];
+            if (pSlot->atomClass == 0 || (pSlot->atomClass == atomClass && pSlot->uMsg == uMsg))
+                return pSlot;
+            iSlot = (iSlot + 1) & (SLOTS_PER_THREAD - 1);
+        }
+        return NULL;
+    }
+
+    static int GetBucket(ULONGLONG nTicks) noexcept
+    {
+        int iBucket = 0;
+        while (nTicks > 1 && iBucket < ATL_MSGPROFILE_STAT::HISTOGRAM_BUCKETS - 1) {
+            nTicks >>= 1;
+            iBucket++;
+        }
+        return iBucket;
+    }
+
+    static void AddClassName(_ThreadBuffer* pBuffer, HWND hWnd, ATOM atomClass) noexcept
+    {
+        for (int i = 0; i < pBuffer->nClassNames; i++) {
+            if (pBuffer->aClassNames[i].atomClass == atomClass)
+                return;
+        }
+        if (pBuffer->nClassNames == CLASSES_PER_THREAD)
+            return;
+
+        _ClassName& name = pBuffer->aClassNames[pBuffer->nClassNames];
+        if (::GetClassNameW(hWnd, name.szName, _countof(name.szName)) == 0)
+            return;
+        name.atomClass = atomClass;
+        pBuffer->nClassNames++;
+    }
+
+    static void GetClassName(const _ThreadBuffer* pBuffer, ATOM atomClass, WCHAR (&szName)[ATL_MSGPROFILE_STAT::MAX_CLASSNAME]) noexcept
+    {
+        for (int i = 0; i < pBuffer->nClassNames; i++) {
+            if (pBuffer->aClassNames[i].atomClass == atomClass) {
+                ::wcscpy_s(szName, _countof(szName), pBuffer->aClassNames[i].szName);
+                return;
+            }
+        }
+        _snwprintf_s(szName, _countof(szName), _TRUNCATE, L"#%u", (UINT)atomClass);
+    }
+
+    _ThreadBuffer* volatile m_pBuffers;
+    volatile LONG m_nGeneration;
+
+    CAtlMsgProfiler(const CAtlMsgProfiler&) = delete;
+    CAtlMsgProfiler& operator=(const CAtlMsgProfiler&) = delete;
+};
+
+__declspec(selectany) CAtlMsgProfiler _AtlMsgProfiler;
+
+// CAtlMsgProfileScope - times one message for the lifetime of the object
+
+class CAtlMsgProfileScope {
+public:
+    CAtlMsgProfileScope(HWND hWnd, UINT uMsg) noexcept
+        : m_uMsg(uMsg)
+    {
+        // Read before the message runs; the window may be gone by the end
+        m_atomClass = (ATOM)::GetClassLongPtrW(hWnd, GCW_ATOM);
+        if (m_atomClass != 0)
+            _AtlMsgProfiler.AddClass(hWnd, m_atomClass);
+        m_nStart = CAtlMsgProfiler::GetTicks();
+    }
+
+    ~CAtlMsgProfileScope()
+    {
+        ULONGLONG nTicks = CAtlMsgProfiler::GetTicks() - m_nStart;
+        if (m_atomClass != 0)
+            _AtlMsgProfiler.Record(m_atomClass, m_uMsg, nTicks);
+    }
+
+private:
+    UINT m_uMsg;
+    ATOM m_atomClass;
+    ULONGLONG m_nStart;
+
+    CAtlMsgProfileScope(const CAtlMsgProfileScope&) = delete;
+    CAtlMsgProfileScope& operator=(const CAtlMsgProfileScope&) = delete;
+};
+
+inline ULONGLONG AtlMsgProfileSnapshot(CSimpleArray<ATL_MSGPROFILE_STAT>& aStats)
+{
+    return _AtlMsgProfiler.Snapshot(aStats);
+}
+
+inline void AtlMsgProfileReset() noexcept
+{
+    _AtlMsgProfiler.Reset();
+}
+
+inline void AtlMsgProfileDump()
+{
+    _AtlMsgProfiler.Dump();
+}
+
+#endif // _ATL_MSG_PROFILE
+
 ///////////////////////////////////////////////////////////////////////////////
 // CWindow - HWND wrapper class
 
@@ -1221,6 +1714,81 @@ struct _ATL_WNDCLASSINFOW {
 
 typedef _ATL_WNDCLASSINFOW CWndClassInfo;
 
+///////////////////////////////////////////////////////////////////////////////
+// Window dispatch traits
+//
+// Select how CWindowImplBaseT and CDialogImplBaseT get from an HWND back to
+// their object. CWndThunkDispatchTraits, the default, subclasses the window
+// with an executable thunk that passes 'this' in place of the HWND.
+//
+// The other traits keep 'this' in the window itself and route every message
+// through a single static procedure, for processes that forbid executable
+// heap memory. That procedure calls WindowProc / DialogProc directly, so
+// GetWindowProc() / GetDialogProc() overrides are not consulted. The slot
+// is shared by every class using the same traits, so only one such object
+// can be attached to a window at a time; SetThis fails while the slot is
+// taken.
+
+class CWndThunkDispatchTraits {
+public:
+    static constexpr bool bUseThunk = true;
+};
+
+// Keeps 'this' in GWLP_USERDATA, which must then be left alone by the window
+class CWndUserDataDispatchTraits {
+public:
+    static constexpr bool bUseThunk = false;
+
+    static BOOL SetThis(HWND hWnd, void* pThis) noexcept
+    {
+        ATLASSERT(GetThis(hWnd) == NULL);
+        if (GetThis(hWnd) != NULL)
+            return FALSE;
+        ::SetLastError(0);
+        return (::SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR)pThis) != 0) || (::GetLastError() == 0);
+    }
+
+    static void* GetThis(HWND hWnd) noexcept
+    {
+        return (void*)::GetWindowLongPtr(hWnd, GWLP_USERDATA);
+    }
+
+    static void RemoveThis(HWND hWnd) noexcept
+    {
+        ::SetWindowLongPtr(hWnd, GWLP_USERDATA, 0);
+    }
+};
+
+// Keeps 'this' in a window property named by a private global atom
+class CWndPropDispatchTraits {
+public:
+    static constexpr bool bUseThunk = false;
+
+    static ATOM GetPropAtom() noexcept
+    {
+        static const ATOM s_atom = ::GlobalAddAtomW(L"OpenATL.WindowImplThis");
+        return s_atom;
+    }
+
+    static BOOL SetThis(HWND hWnd, void* pThis) noexcept
+    {
+        ATLASSERT(GetThis(hWnd) == NULL);
+        if (GetThis(hWnd) != NULL)
+            return FALSE;
+        return ::SetPropW(hWnd, MAKEINTATOM(GetPropAtom()), (HANDLE)pThis);
+    }
+
+    static void* GetThis(HWND hWnd) noexcept
+    {
+        return (void*)::GetPropW(hWnd, MAKEINTATOM(GetPropAtom()));
+    }
+
+    static void RemoveThis(HWND hWnd) noexcept
+    {
+        ::RemovePropW(hWnd, MAKEINTATOM(GetPropAtom()));
+    }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // CWindowImplRoot - root class for CWindowImpl hierarchy
 
@@ -1382,9 +1950,11 @@ public:
 ///////////////////////////////////////////////////////////////////////////////
 // CWindowImplBaseT - base class for CWindowImpl
 
-template <typename TBase = CWindow, typename TWinTraits = CControlWinTraits>
+template <typename TBase = CWindow, typename TWinTraits = CControlWinTraits, typename TDispatchTraits = CWndThunkDispatchTraits>
 class ATL_NO_VTABLE CWindowImplBaseT : public CWindowImplRoot<TBase> {
 public:
+    typedef CWindowImplBaseT<TBase, TWinTraits, TDispatchTraits> thisClass;
+
     // m_pfnSuperWindowProc is inherited from CWindowImplRoot
 
     CWindowImplBaseT() noexcept
@@ -1408,29 +1978,56 @@ public:
 
     static LRESULT CALLBACK StartWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     {
-        CWindowImplBaseT<TBase, TWinTraits>* pThis =
-            (CWindowImplBaseT<TBase, TWinTraits>*)_AtlWinModule.ExtractCreateWndData();
+        thisClass* pThis = (thisClass*)_AtlWinModule.ExtractCreateWndData();
         ATLASSERT(pThis != NULL);
         if (pThis == NULL)
             return 0;
 
         pThis->m_hWnd = hWnd;
 
-        // Initialize the thunk
-        pThis->m_thunk.Init(pThis->GetWindowProc(), pThis);
-        WNDPROC pProc = pThis->m_thunk.GetWndProc();
+        if constexpr (!TDispatchTraits::bUseThunk) {
+            if (!TDispatchTraits::SetThis(hWnd, pThis)) {
+                // Leave the window to its class procedure; Create sees
+                // m_hWnd unset and destroys it
+                pThis->m_hWnd = NULL;
+                ::SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)pThis->m_pfnSuperWindowProc);
+                return ::CallWindowProc(pThis->m_pfnSuperWindowProc, hWnd, uMsg, wParam, lParam);
+            }
+            ::SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)DirectWindowProc);
+            return WindowProc((HWND)pThis, uMsg, wParam, lParam);
+        } else {
+            // Initialize the thunk
+            pThis->m_thunk.Init(pThis->GetWindowProc(), pThis);
+            WNDPROC pProc = pThis->m_thunk.GetWndProc();
 
-        // Subclass the window with the thunk
-        ::SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)pProc);
+            // Subclass the window with the thunk
+            ::SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)pProc);
 
-        // Process the first message through the thunk
-        return pProc(hWnd, uMsg, wParam, lParam);
+            // Process the first message through the thunk
+            return pProc(hWnd, uMsg, wParam, lParam);
+        }
+    }
+
+    // Window procedure used instead of the thunk by thunk-free dispatch traits
+    static LRESULT CALLBACK DirectWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+    {
+        thisClass* pThis = (thisClass*)TDispatchTraits::GetThis(hWnd);
+        if (pThis == NULL)
+            return ::DefWindowProc(hWnd, uMsg, wParam, lParam);
+
+        // The object may be gone once WindowProc returns
+        if (uMsg == WM_NCDESTROY)
+            TDispatchTraits::RemoveThis(hWnd);
+
+        return WindowProc((HWND)pThis, uMsg, wParam, lParam);
     }
 
     static LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     {
-        CWindowImplBaseT<TBase, TWinTraits>* pThis =
-            (CWindowImplBaseT<TBase, TWinTraits>*)hWnd;
+        thisClass* pThis = (thisClass*)hWnd;
+#ifdef _ATL_MSG_PROFILE
+        CAtlMsgProfileScope profileScope(pThis->m_hWnd, uMsg);
+#endif
         _ATL_MSG msg(pThis->m_hWnd, uMsg, wParam, lParam);
         const _ATL_MSG* pOldMsg = pThis->m_pCurrentMsg;
         pThis->m_pCurrentMsg = &msg;
@@ -1484,10 +2081,12 @@ public:
     {
         ATLASSERT(this->m_hWnd == NULL);
 
-        BOOL bRet = this->m_thunk.Init(NULL, NULL);
-        if (bRet == FALSE) {
-            ::SetLastError(ERROR_OUTOFMEMORY);
-            return NULL;
+        if constexpr (TDispatchTraits::bUseThunk) {
+            BOOL bRet = this->m_thunk.Init(NULL, NULL);
+            if (bRet == FALSE) {
+                ::SetLastError(ERROR_OUTOFMEMORY);
+                return NULL;
+            }
         }
 
         if (atom == 0)
@@ -1507,7 +2106,13 @@ public:
             hWndParent, MenuOrID.m_hMenu,
             _AtlBaseModule.GetModuleInstance(), lpCreateParam);
 
-        ATLASSERT((hWnd == NULL) || (this->m_hWnd == hWnd));
+        if ((hWnd != NULL) && (this->m_hWnd != hWnd)) {
+            // StartWindowProc could not attach this object to the window
+            ATLASSERT(this->m_hWnd == NULL);
+            ::DestroyWindow(hWnd);
+            ::SetLastError(ERROR_OUTOFMEMORY);
+            return NULL;
+        }
         return hWnd;
     }
 
@@ -1516,14 +2121,24 @@ public:
         ATLASSERT(this->m_hWnd == NULL);
         ATLASSERT(::IsWindow(hWnd));
 
-        BOOL bRet = this->m_thunk.Init(GetWindowProc(), this);
-        if (bRet == FALSE)
-            return FALSE;
+        WNDPROC pProc = NULL;
+        if constexpr (TDispatchTraits::bUseThunk) {
+            BOOL bRet = this->m_thunk.Init(GetWindowProc(), this);
+            if (bRet == FALSE)
+                return FALSE;
+            pProc = this->m_thunk.GetWndProc();
+        } else {
+            if (!TDispatchTraits::SetThis(hWnd, this))
+                return FALSE;
+            pProc = DirectWindowProc;
+        }
 
-        WNDPROC pProc = this->m_thunk.GetWndProc();
         WNDPROC pfnWndProc = (WNDPROC)::SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)pProc);
-        if (pfnWndProc == NULL)
+        if (pfnWndProc == NULL) {
+            if constexpr (!TDispatchTraits::bUseThunk)
+                TDispatchTraits::RemoveThis(hWnd);
             return FALSE;
+        }
 
         this->m_pfnSuperWindowProc = pfnWndProc;
         this->m_hWnd = hWnd;
@@ -1534,7 +2149,11 @@ public:
     {
         ATLASSERT(this->m_hWnd != NULL);
 
-        WNDPROC pOurProc = this->m_thunk.GetWndProc();
+        WNDPROC pOurProc = NULL;
+        if constexpr (TDispatchTraits::bUseThunk)
+            pOurProc = this->m_thunk.GetWndProc();
+        else
+            pOurProc = DirectWindowProc;
         WNDPROC pActiveProc = (WNDPROC)::GetWindowLongPtr(this->m_hWnd, GWLP_WNDPROC);
 
         HWND hWnd = NULL;
@@ -1542,6 +2161,9 @@ public:
             if (!::SetWindowLongPtr(this->m_hWnd, GWLP_WNDPROC, (LONG_PTR)this->m_pfnSuperWindowProc))
                 return NULL;
 
+            if constexpr (!TDispatchTraits::bUseThunk)
+                TDispatchTraits::RemoveThis(this->m_hWnd);
+
             this->m_pfnSuperWindowProc = ::DefWindowProc;
             hWnd = this->m_hWnd;
             this->m_hWnd = NULL;
@@ -1550,6 +2172,172 @@ public:
     }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Message table support for BEGIN_MSG_TABLE
+//
+// A message table is a message map whose entries are collected into a
+// constexpr array and sorted at compile time on (map ID, kind, message,
+// control ID). Dispatch binary-searches three runs of the current map:
+// entries for this exact WM_COMMAND / WM_NOTIFY control ID, entries for
+// this message, and catch-all entries (chains, ranges, forwarding). The
+// runs are then merged back into declaration order, so CHAIN_MSG_MAP and
+// ALT_MSG_MAP behave exactly as in a BEGIN_MSG_MAP map.
+
+enum _AtlMsgTableKind {
+    _ATL_MSGTABLE_MSGID = 0,    // one message from one control ID
+    _ATL_MSGTABLE_MSG = 1,      // one message
+    _ATL_MSGTABLE_ANY = 2,      // consulted for every message
+    _ATL_MSGTABLE_ALT = 3,      // starts an alternate map, nID is the map ID
+    _ATL_MSGTABLE_END = 4
+};
+
+template <typename T>
+struct _AtlMsgTableEntry {
+    typedef BOOL (*PFNHANDLER)(T* pThis, HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult);
+
+    UINT nKind;
+    UINT uMsg;
+    UINT_PTR nID;
+    PFNHANDLER pfnHandler;
+};
+
+template <typename T, int t_nEntries>
+struct _AtlMsgTable {
+    struct _Row {
+        DWORD dwMsgMapID;
+        UINT nKind;
+        UINT uMsg;
+        UINT_PTR nID;
+        int nOrder;
+        typename _AtlMsgTableEntry<T>::PFNHANDLER pfnHandler;
+    };
+
+    _Row m_aRows[t_nEntries];
+    int m_nRows;
+
+    // Orders rows by (map ID, kind, message, control ID), ignoring nOrder
+    static constexpr int CompareKey(const _Row& row, DWORD dwMsgMapID, UINT nKind, UINT uMsg, UINT_PTR nID) noexcept
+    {
+        if (row.dwMsgMapID != dwMsgMapID)
+            return (row.dwMsgMapID < dwMsgMapID) ? -1 : 1;
+        if (row.nKind != nKind)
+            return (row.nKind < nKind) ? -1 : 1;
+        if (row.uMsg != uMsg)
+            return (row.uMsg < uMsg) ? -1 : 1;
+        if (row.nID != nID)
+            return (row.nID < nID) ? -1 : 1;
+        return 0;
+    }
+
+    static constexpr bool IsLess(const _Row& a, const _Row& b) noexcept
+    {
+        int nCmp = CompareKey(a, b.dwMsgMapID, b.nKind, b.uMsg, b.nID);
+        return (nCmp < 0) || (nCmp == 0 && a.nOrder < b.nOrder);
+    }
+
+    // Sets [iBegin, iEnd) to the rows matching the key, in declaration order
+    void FindRun(DWORD dwMsgMapID, UINT nKind, UINT uMsg, UINT_PTR nID, int& iBegin, int& iEnd) const noexcept
+    {
+        int nLow = 0;
+        int nHigh = m_nRows;
+        while (nLow < nHigh) {
+            int nMid = (nLow + nHigh) / 2;
+            if (CompareKey(m_aRows[nMid], dwMsgMapID, nKind, uMsg, nID) < 0)
+                nLow = nMid + 1;
+            else
+                nHigh = nMid;
+        }
+        iBegin = nLow;
+        iEnd = nLow;
+        while (iEnd < m_nRows && CompareKey(m_aRows[iEnd], dwMsgMapID, nKind, uMsg, nID) == 0)
+            iEnd++;
+    }
+};
+
+template <typename T, int t_nEntries>
+constexpr _AtlMsgTable<T, t_nEntries> AtlBuildMsgTable(const _AtlMsgTableEntry<T> (&aEntries)[t_nEntries])
+{
+    typedef _AtlMsgTable<T, t_nEntries> TTable;
+    typedef typename TTable::_Row TRow;
+
+    TTable table = {};
+    TRow aTemp[t_nEntries] = {};
+
+    // Resolve ALT_MSG_MAP sections into a map ID per row. ALT rows are kept
+    // so that dispatch can tell an empty alternate map from an unknown one.
+    DWORD dwMsgMapID = 0;
+    int nRows = 0;
+    for (int i = 0; i < t_nEntries && aEntries[i].nKind != _ATL_MSGTABLE_END; i++) {
+        if (aEntries[i].nKind == _ATL_MSGTABLE_ALT)
+            dwMsgMapID = (DWORD)aEntries[i].nID;
+        TRow row = { dwMsgMapID, aEntries[i].nKind, aEntries[i].uMsg, aEntries[i].nID, i, aEntries[i].pfnHandler };
+        table.m_aRows[nRows++] = row;
+    }
+    table.m_nRows = nRows;
+
+    // Bottom-up merge sort, keeping compile time at O(n log n) for large maps
+    for (int nWidth = 1; nWidth < nRows; nWidth *= 2) {
+        for (int iLeft = 0; iLeft < nRows; iLeft += 2 * nWidth) {
+            int iMid = (iLeft + nWidth < nRows) ? iLeft + nWidth : nRows;
+            int iRight = (iLeft + 2 * nWidth < nRows) ? iLeft + 2 * nWidth : nRows;
+            int i = iLeft;
+            int j = iMid;
+            int k = iLeft;
+            while (i < iMid && j < iRight)
+                aTemp[k++] = TTable::IsLess(table.m_aRows[j], table.m_aRows[i]) ? table.m_aRows[j++] : table.m_aRows[i++];
+            while (i < iMid)
+                aTemp[k++] = table.m_aRows[i++];
+            while (j < iRight)
+                aTemp[k++] = table.m_aRows[j++];
+        }
+        for (int i = 0; i < nRows; i++)
+            table.m_aRows[i] = aTemp[i];
+    }
+
+    return table;
+}
+
+template <typename T, int t_nEntries>
+inline BOOL AtlDispatchMsgTable(const _AtlMsgTable<T, t_nEntries>& table, T* pThis,
+    HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult, DWORD dwMsgMapID)
+{
+#ifdef _DEBUG
+    if (dwMsgMapID != 0) {
+        int iAltBegin = 0, iAltEnd = 0;
+        table.FindRun(dwMsgMapID, _ATL_MSGTABLE_ALT, 0, dwMsgMapID, iAltBegin, iAltEnd);
+        if (iAltBegin == iAltEnd) {
+            ATLTRACE2(atlTraceWindowing, 0, _T("Invalid message map ID (%i)\n"), dwMsgMapID);
+            ATLASSERT(FALSE);
+            return FALSE;
+        }
+    }
+#endif
+
+    int aBegin[3] = { 0, 0, 0 };
+    int aEnd[3] = { 0, 0, 0 };
+
+    if (uMsg == WM_COMMAND)
+        table.FindRun(dwMsgMapID, _ATL_MSGTABLE_MSGID, uMsg, LOWORD(wParam), aBegin[0], aEnd[0]);
+    else if (uMsg == WM_NOTIFY)
+        table.FindRun(dwMsgMapID, _ATL_MSGTABLE_MSGID, uMsg, ((LPNMHDR)lParam)->idFrom, aBegin[0], aEnd[0]);
+    table.FindRun(dwMsgMapID, _ATL_MSGTABLE_MSG, uMsg, 0, aBegin[1], aEnd[1]);
+    table.FindRun(dwMsgMapID, _ATL_MSGTABLE_ANY, 0, 0, aBegin[2], aEnd[2]);
+
+    for (;;) {
+        int iRun = -1;
+        for (int r = 0; r < 3; r++) {
+            if (aBegin[r] < aEnd[r] &&
+                (iRun < 0 || table.m_aRows[aBegin[r]].nOrder < table.m_aRows[aBegin[iRun]].nOrder))
+                iRun = r;
+        }
+        if (iRun < 0)
+            return FALSE;
+
+        if (table.m_aRows[aBegin[iRun]++].pfnHandler(pThis, hWnd, uMsg, wParam, lParam, lResult))
+            return TRUE;
+    }
+}
+
 } // namespace ATL (temporarily close for macro definitions)
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1845,6 +2633,199 @@ public: \
         return FALSE; \
     }
 
+///////////////////////////////////////////////////////////////////////////////
+// Message table macros
+//
+// Drop-in alternative to BEGIN_MSG_MAP for large maps: the entries below
+// mirror the standard handler macros, but build a table that is sorted at
+// compile time (see AtlBuildMsgTable), so unhandled messages cost a few
+// binary searches instead of one test per entry.
+//
+//   BEGIN_MSG_TABLE(CMyWindow)
+//       TABLE_MESSAGE_HANDLER(WM_CREATE, OnCreate)
+//       TABLE_COMMAND_ID_HANDLER(ID_FILE_OPEN, OnFileOpen)
+//       TABLE_CHAIN_MSG_MAP(CMyBase)
+//   TABLE_ALT_MSG_MAP(1)
+//       TABLE_MESSAGE_HANDLER(WM_CHAR, OnEditChar)
+//   END_MSG_TABLE()
+
+#define BEGIN_MSG_TABLE(theClass) \
+public: \
+    BOOL ProcessWindowMessage(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult, DWORD dwMsgMapID = 0) \
+    { \
+        typedef theClass _atlMsgTableClass; \
+        static constexpr ATL::_AtlMsgTableEntry<_atlMsgTableClass> _atlMsgTableEntries[] = {
+
+#define TABLE_ALT_MSG_MAP(msgMapID) \
+            { ATL::_ATL_MSGTABLE_ALT, 0, (UINT_PTR)(msgMapID), NULL },
+
+#define END_MSG_TABLE() \
+            { ATL::_ATL_MSGTABLE_END, 0, 0, NULL } \
+        }; \
+        static constexpr auto _atlMsgTable = ATL::AtlBuildMsgTable(_atlMsgTableEntries); \
+        return ATL::AtlDispatchMsgTable(_atlMsgTable, this, hWnd, uMsg, wParam, lParam, lResult, dwMsgMapID); \
+    }
+
+#define TABLE_MESSAGE_HANDLER(msg, func) \
+            { ATL::_ATL_MSGTABLE_MSG, msg, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(uMsg, wParam, lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_MESSAGE_RANGE_HANDLER(msgFirst, msgLast, func) \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (uMsg < msgFirst || uMsg > msgLast) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(uMsg, wParam, lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_COMMAND_HANDLER(id, code, func) \
+            { ATL::_ATL_MSGTABLE_MSGID, WM_COMMAND, (UINT_PTR)(id), \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (code != HIWORD(wParam)) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(HIWORD(wParam), LOWORD(wParam), (HWND)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_COMMAND_ID_HANDLER(id, func) \
+            { ATL::_ATL_MSGTABLE_MSGID, WM_COMMAND, (UINT_PTR)(id), \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(HIWORD(wParam), LOWORD(wParam), (HWND)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_COMMAND_CODE_HANDLER(code, func) \
+            { ATL::_ATL_MSGTABLE_MSG, WM_COMMAND, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (code != HIWORD(wParam)) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(HIWORD(wParam), LOWORD(wParam), (HWND)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_COMMAND_RANGE_HANDLER(idFirst, idLast, func) \
+            { ATL::_ATL_MSGTABLE_MSG, WM_COMMAND, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (LOWORD(wParam) < idFirst || LOWORD(wParam) > idLast) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(HIWORD(wParam), LOWORD(wParam), (HWND)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_COMMAND_RANGE_CODE_HANDLER(idFirst, idLast, code, func) \
+            { ATL::_ATL_MSGTABLE_MSG, WM_COMMAND, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (code != HIWORD(wParam) || LOWORD(wParam) < idFirst || LOWORD(wParam) > idLast) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func(HIWORD(wParam), LOWORD(wParam), (HWND)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_NOTIFY_HANDLER(id, cd, func) \
+            { ATL::_ATL_MSGTABLE_MSGID, WM_NOTIFY, (UINT_PTR)(id), \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (cd != ((LPNMHDR)lParam)->code) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func((int)wParam, (LPNMHDR)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_NOTIFY_ID_HANDLER(id, func) \
+            { ATL::_ATL_MSGTABLE_MSGID, WM_NOTIFY, (UINT_PTR)(id), \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func((int)wParam, (LPNMHDR)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_NOTIFY_CODE_HANDLER(cd, func) \
+            { ATL::_ATL_MSGTABLE_MSG, WM_NOTIFY, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (cd != ((LPNMHDR)lParam)->code) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func((int)wParam, (LPNMHDR)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_NOTIFY_RANGE_HANDLER(idFirst, idLast, func) \
+            { ATL::_ATL_MSGTABLE_MSG, WM_NOTIFY, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (((LPNMHDR)lParam)->idFrom < idFirst || ((LPNMHDR)lParam)->idFrom > idLast) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func((int)wParam, (LPNMHDR)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_NOTIFY_RANGE_CODE_HANDLER(idFirst, idLast, cd, func) \
+            { ATL::_ATL_MSGTABLE_MSG, WM_NOTIFY, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  if (cd != ((LPNMHDR)lParam)->code || ((LPNMHDR)lParam)->idFrom < idFirst || ((LPNMHDR)lParam)->idFrom > idLast) \
+                      return FALSE; \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->func((int)wParam, (LPNMHDR)lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_CHAIN_MSG_MAP(theChainClass) \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  return pThis->theChainClass::ProcessWindowMessage(hWnd, uMsg, wParam, lParam, lResult); \
+              } },
+
+#define TABLE_CHAIN_MSG_MAP_ALT(theChainClass, msgMapID) \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  return pThis->theChainClass::ProcessWindowMessage(hWnd, uMsg, wParam, lParam, lResult, msgMapID); \
+              } },
+
+#define TABLE_CHAIN_MSG_MAP_MEMBER(theChainMember) \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  return pThis->theChainMember.ProcessWindowMessage(hWnd, uMsg, wParam, lParam, lResult); \
+              } },
+
+#define TABLE_CHAIN_MSG_MAP_ALT_MEMBER(theChainMember, msgMapID) \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  return pThis->theChainMember.ProcessWindowMessage(hWnd, uMsg, wParam, lParam, lResult, msgMapID); \
+              } },
+
+#define TABLE_FORWARD_NOTIFICATIONS() \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->ForwardNotifications(uMsg, wParam, lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_REFLECT_NOTIFICATIONS() \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  BOOL bHandled = TRUE; \
+                  lResult = pThis->ReflectNotifications(uMsg, wParam, lParam, bHandled); \
+                  return bHandled; \
+              } },
+
+#define TABLE_DEFAULT_REFLECTION_HANDLER() \
+            { ATL::_ATL_MSGTABLE_ANY, 0, 0, \
+              [](_atlMsgTableClass* pThis, HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT& lResult) -> BOOL { \
+                  return pThis->DefaultReflectionHandler(hWnd, uMsg, wParam, lParam, lResult); \
+              } },
+
 ///////////////////////////////////////////////////////////////////////////////
 // Window Class Macros
 
@@ -1889,10 +2870,10 @@ namespace ATL { // reopen namespace
 ///////////////////////////////////////////////////////////////////////////////
 // CWindowImpl - implements a window
 
-template <typename T, typename TBase = CWindow, typename TWinTraits = CControlWinTraits>
-class ATL_NO_VTABLE CWindowImpl : public CWindowImplBaseT<TBase, TWinTraits> {
+template <typename T, typename TBase = CWindow, typename TWinTraits = CControlWinTraits, typename TDispatchTraits = CWndThunkDispatchTraits>
+class ATL_NO_VTABLE CWindowImpl : public CWindowImplBaseT<TBase, TWinTraits, TDispatchTraits> {
 public:
-    using CWindowImplBaseT<TBase, TWinTraits>::StartWindowProc;
+    using CWindowImplBaseT<TBase, TWinTraits, TDispatchTraits>::StartWindowProc;
 
     DECLARE_WND_CLASS(nullptr)
 
@@ -1907,7 +2888,7 @@ public:
         dwStyle = T::GetWndStyle(dwStyle);
         dwExStyle = T::GetWndExStyle(dwExStyle);
 
-        return CWindowImplBaseT<TBase, TWinTraits>::Create(hWndParent, rect, szWindowName,
+        return CWindowImplBaseT<TBase, TWinTraits, TDispatchTraits>::Create(hWndParent, rect, szWindowName,
             dwStyle, dwExStyle, MenuOrID, atom, lpCreateParam);
     }
 };
@@ -1915,9 +2896,11 @@ public:
 ///////////////////////////////////////////////////////////////////////////////
 // CDialogImplBaseT - base class for CDialogImpl
 
-template <typename TBase = CWindow>
+template <typename TBase = CWindow, typename TDispatchTraits = CWndThunkDispatchTraits>
 class ATL_NO_VTABLE CDialogImplBaseT : public CWindowImplRoot<TBase> {
 public:
+    typedef CDialogImplBaseT<TBase, TDispatchTraits> thisClass;
+
     virtual DLGPROC GetDialogProc()
     {
         return DialogProc;
@@ -1925,23 +2908,53 @@ public:
 
     static INT_PTR CALLBACK StartDialogProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     {
-        CDialogImplBaseT<TBase>* pThis =
-            (CDialogImplBaseT<TBase>*)_AtlWinModule.ExtractCreateWndData();
+        thisClass* pThis = (thisClass*)_AtlWinModule.ExtractCreateWndData();
         ATLASSERT(pThis != NULL);
         if (pThis == NULL)
             return 0;
 
         pThis->m_hWnd = hWnd;
-        pThis->m_thunk.Init((WNDPROC)pThis->GetDialogProc(), pThis);
-        DLGPROC pProc = (DLGPROC)pThis->m_thunk.GetWndProc();
-        ::SetWindowLongPtr(hWnd, DWLP_DLGPROC, (LONG_PTR)pProc);
 
-        return pProc(hWnd, uMsg, wParam, lParam);
+        if constexpr (!TDispatchTraits::bUseThunk) {
+            if (!TDispatchTraits::SetThis(hWnd, pThis)) {
+                // Detach the dialog procedure and end the dialog: DoModal
+                // returns -1, and Create sees m_hWnd unset and destroys it
+                pThis->m_hWnd = NULL;
+                ::SetWindowLongPtr(hWnd, DWLP_DLGPROC, 0);
+                ::EndDialog(hWnd, -1);
+                return FALSE;
+            }
+            ::SetWindowLongPtr(hWnd, DWLP_DLGPROC, (LONG_PTR)DirectDialogProc);
+            return DialogProc((HWND)pThis, uMsg, wParam, lParam);
+        } else {
+            pThis->m_thunk.Init((WNDPROC)pThis->GetDialogProc(), pThis);
+            DLGPROC pProc = (DLGPROC)pThis->m_thunk.GetWndProc();
+            ::SetWindowLongPtr(hWnd, DWLP_DLGPROC, (LONG_PTR)pProc);
+
+            return pProc(hWnd, uMsg, wParam, lParam);
+        }
+    }
+
+    // Dialog procedure used instead of the thunk by thunk-free dispatch traits
+    static INT_PTR CALLBACK DirectDialogProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+    {
+        thisClass* pThis = (thisClass*)TDispatchTraits::GetThis(hWnd);
+        if (pThis == NULL)
+            return FALSE;
+
+        // The object may be gone once DialogProc returns
+        if (uMsg == WM_NCDESTROY)
+            TDispatchTraits::RemoveThis(hWnd);
+
+        return DialogProc((HWND)pThis, uMsg, wParam, lParam);
     }
 
     static INT_PTR CALLBACK DialogProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     {
-        CDialogImplBaseT<TBase>* pThis = (CDialogImplBaseT<TBase>*)hWnd;
+        thisClass* pThis = (thisClass*)hWnd;
+#ifdef _ATL_MSG_PROFILE
+        CAtlMsgProfileScope profileScope(pThis->m_hWnd, uMsg);
+#endif
         _ATL_MSG msg(pThis->m_hWnd, uMsg, wParam, lParam);
         const _ATL_MSG* pOldMsg = pThis->m_pCurrentMsg;
         pThis->m_pCurrentMsg = &msg;
@@ -1995,16 +3008,18 @@ public:
 ///////////////////////////////////////////////////////////////////////////////
 // CDialogImpl - implements a dialog
 
-template <typename T, typename TBase = CWindow>
-class ATL_NO_VTABLE CDialogImpl : public CDialogImplBaseT<TBase> {
+template <typename T, typename TBase = CWindow, typename TDispatchTraits = CWndThunkDispatchTraits>
+class ATL_NO_VTABLE CDialogImpl : public CDialogImplBaseT<TBase, TDispatchTraits> {
 public:
     HWND Create(HWND hWndParent, LPARAM dwInitParam = NULL) noexcept
     {
         ATLASSERT(this->m_hWnd == NULL);
-        BOOL bRet = this->m_thunk.Init(NULL, NULL);
-        if (bRet == FALSE) {
-            ::SetLastError(ERROR_OUTOFMEMORY);
-            return NULL;
+        if constexpr (TDispatchTraits::bUseThunk) {
+            BOOL bRet = this->m_thunk.Init(NULL, NULL);
+            if (bRet == FALSE) {
+                ::SetLastError(ERROR_OUTOFMEMORY);
+                return NULL;
+            }
         }
 
         _AtlWinModule.AddCreateWndData(&this->m_thunk.cd, this);
@@ -2019,7 +3034,13 @@ public:
             T::StartDialogProc, dwInitParam);
 #endif
 
-        ATLASSERT((hWnd == NULL) || (this->m_hWnd == hWnd));
+        if ((hWnd != NULL) && (this->m_hWnd != hWnd)) {
+            // StartDialogProc could not attach this object to the dialog
+            ATLASSERT(this->m_hWnd == NULL);
+            ::DestroyWindow(hWnd);
+            ::SetLastError(ERROR_OUTOFMEMORY);
+            return NULL;
+        }
         return hWnd;
     }
 
@@ -2032,10 +3053,12 @@ public:
     INT_PTR DoModal(HWND hWndParent = ::GetActiveWindow(), LPARAM dwInitParam = NULL) noexcept
     {
         ATLASSERT(this->m_hWnd == NULL);
-        BOOL bRet = this->m_thunk.Init(NULL, NULL);
-        if (bRet == FALSE) {
-            ::SetLastError(ERROR_OUTOFMEMORY);
-            return -1;
+        if constexpr (TDispatchTraits::bUseThunk) {
+            BOOL bRet = this->m_thunk.Init(NULL, NULL);
+            if (bRet == FALSE) {
+                ::SetLastError(ERROR_OUTOFMEMORY);
+                return -1;
+            }
         }
 
         _AtlWinModule.AddCreateWndData(&this->m_thunk.cd, this);
@@ -2134,6 +3157,9 @@ public:
     {
         CContainedWindowT<TBase, TWinTraits>* pThis =
             (CContainedWindowT<TBase, TWinTraits>*)hWnd;
+#ifdef _ATL_MSG_PROFILE
+        CAtlMsgProfileScope profileScope(pThis->m_hWnd, uMsg);
+#endif
 
         _ATL_MSG msg(pThis->m_hWnd, uMsg, wParam, lParam);
         const _ATL_MSG* pOldMsg = pThis->m_pCurrentMsg;